@@ -4,8 +4,17 @@
 #include <string>
 #include <mutex>
 #include <list>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <utility>
+#include <bitset>
+#include <cassert>
+#include <cmath>
 #include <boost/type_index.hpp>
 #include <boost/uuid/uuid.hpp>
+#include <boost/utility/string_view.hpp>
 #include <boost/geometry.hpp>
 #include <boost/geometry/geometries/point.hpp>
 
@@ -19,7 +28,7 @@
 #  define BASIS_EXPORT
 #endif
 
-#define TYPEID(T) typeid(T).hash_code()
+#define TYPEID(T) ::Basis::typeIdOf<T>()
 #define TYPENAME(T) typeid(T).name()
 
 namespace Basis
@@ -31,15 +40,198 @@ typedef bg::model::point<double, 3, bg::cs::cartesian> point3d;
 using tid = size_t;             // псевдоним для идентификатора типа
 using uid = boost::uuids::uuid; // псевдоним для идентификатора сущности
 
-point3d BASIS_EXPORT operator+(const point3d& p1, const point3d& p2);
-point3d BASIS_EXPORT operator-(const point3d& p1, const point3d& p2);
-point3d BASIS_EXPORT operator*(const point3d& p, double v);
-point3d BASIS_EXPORT operator*(double v, const point3d& p);
-double BASIS_EXPORT length(const point3d& v);
+const tid MaxEntityTypes = 256;                  /// предельное число различных типов сущностей
+const tid InvalidTypeId = static_cast<tid>(-1);  /// недействительный идентификатор типа
+
+/// @brief Получить идентификатор типа по его (платформенному) имени.
+///
+/// Идентификаторы - небольшие последовательные числа, которые выдаются при первом
+/// обращении к типу (как правило, в registerEntity<T>()). Реестр находится в ядре,
+/// поэтому тип получает один и тот же номер во всех модулях, загруженных через loadModules.
+/// @return InvalidTypeId, если лимит MaxEntityTypes исчерпан
+tid BASIS_EXPORT typeIdByName(const char* typeName);
+
+/// @brief Получить идентификатор типа T.
+template <class T>
+tid typeIdOf()
+{
+	static const tid id = typeIdByName(typeid(T).name());
+	return id;
+}
+
+inline point3d operator+(const point3d& p1, const point3d& p2)
+{
+	return point3d(p1.get<0>() + p2.get<0>(), p1.get<1>() + p2.get<1>(), p1.get<2>() + p2.get<2>());
+}
+
+inline point3d operator-(const point3d& p1, const point3d& p2)
+{
+	return point3d(p1.get<0>() - p2.get<0>(), p1.get<1>() - p2.get<1>(), p1.get<2>() - p2.get<2>());
+}
+
+inline point3d operator*(const point3d& p, double v)
+{
+	return point3d(p.get<0>() * v, p.get<1>() * v, p.get<2>() * v);
+}
+
+inline point3d operator*(double v, const point3d& p)
+{
+	return p * v;
+}
+
+inline double length(const point3d& v)
+{
+	double x = v.get<0>();
+	double y = v.get<1>();
+	double z = v.get<2>();
+
+	return std::sqrt(x*x + y*y + z*z);
+}
+
+/// @brief Массивы координат точек (по массиву на каждую координату).
+struct PointArrays
+{
+	size_t size = 0;     /// число точек
+	double* x = nullptr;
+	double* y = nullptr;
+	double* z = nullptr;
+};
+
+/// @brief Пакетная обработка точек, заданных массивами координат.
+///
+/// Реализация выбирается при запуске по возможностям процессора: AVX2, SSE2
+/// или обычный цикл. Массивы одного вызова должны иметь одинаковый размер
+/// (берётся размер первого аргумента).
+namespace Batch {
+	/// @brief Набор команд, используемый пакетными функциями.
+	enum class SimdLevel
+	{
+		Scalar,
+		SSE2,
+		AVX2
+	};
+
+	/// @brief Получить наилучший набор команд, доступный на этом процессоре.
+	SimdLevel BASIS_EXPORT supportedSimdLevel();
+	/// @brief Получить текущий набор команд.
+	SimdLevel BASIS_EXPORT simdLevel();
+	/// @brief Выбрать набор команд (не выше доступного; например, для сравнения результатов).
+	void BASIS_EXPORT setSimdLevel(SimdLevel level);
+
+	/// @brief Сдвинуть все точки: p += offset.
+	void BASIS_EXPORT translate(const PointArrays& points, const point3d& offset);
+	/// @brief Умножить все точки на число: p *= factor.
+	void BASIS_EXPORT scale(const PointArrays& points, double factor);
+	/// @brief Прибавить к точкам y точки x, умноженные на a: y += a * x.
+	void BASIS_EXPORT axpy(const PointArrays& y, double a, const PointArrays& x);
+	/// @brief Вычислить расстояния между соответствующими точками: out[i] = |a[i] - b[i]|.
+	void BASIS_EXPORT distance(const PointArrays& a, const PointArrays& b, double* out);
+	/// @brief Вычислить длины векторов: out[i] = |p[i]|.
+	void BASIS_EXPORT length(const PointArrays& points, double* out);
+	/// @brief Привести векторы к единичной длине (нулевые векторы не меняются).
+	void BASIS_EXPORT normalize(const PointArrays& points);
+
+} // namespace Batch
 
 class Entity;
 class System;
 
+/// @brief Множество идентификаторов типов в виде битовой маски.
+class FacetMask
+{
+public:
+	/// @brief Содержит ли множество данный тип?
+	bool test(tid typeId) const
+	{
+		if (typeId >= MaxEntityTypes)
+			return false;
+		return ((_words[typeId >> 6] >> (typeId & 63)) & 1) != 0;
+	}
+	/// @brief Добавить тип в множество (недопустимый идентификатор игнорируется).
+	void set(tid typeId)
+	{
+		if (typeId < MaxEntityTypes)
+			_words[typeId >> 6] |= (uint64_t(1) << (typeId & 63));
+	}
+	/// @brief Исключить тип из множества.
+	void reset(tid typeId)
+	{
+		if (typeId < MaxEntityTypes)
+			_words[typeId >> 6] &= ~(uint64_t(1) << (typeId & 63));
+	}
+	/// @brief Число типов в множестве.
+	size_t count() const
+	{
+		size_t n = 0;
+		for (size_t i = 0; i < Words; ++i)
+			n += std::bitset<64>(_words[i]).count();
+		return n;
+	}
+	/// @brief Число типов в множестве с идентификатором меньше typeId.
+	size_t rank(tid typeId) const
+	{
+		if (typeId >= MaxEntityTypes)
+			return count();
+		size_t w = typeId >> 6;
+		size_t n = std::bitset<64>(_words[w] & ((uint64_t(1) << (typeId & 63)) - 1)).count();
+		for (size_t i = 0; i < w; ++i)
+			n += std::bitset<64>(_words[i]).count();
+		return n;
+	}
+	/// @brief Содержит ли это множество все типы из other?
+	bool contains(const FacetMask& other) const
+	{
+		for (size_t i = 0; i < Words; ++i) {
+			if ((_words[i] & other._words[i]) != other._words[i])
+				return false;
+		}
+		return true;
+	}
+	/// @brief Есть ли у множеств общие типы?
+	bool intersects(const FacetMask& other) const
+	{
+		for (size_t i = 0; i < Words; ++i) {
+			if (_words[i] & other._words[i])
+				return true;
+		}
+		return false;
+	}
+	bool none() const
+	{
+		for (size_t i = 0; i < Words; ++i) {
+			if (_words[i])
+				return false;
+		}
+		return true;
+	}
+	FacetMask& operator|=(const FacetMask& other)
+	{
+		for (size_t i = 0; i < Words; ++i)
+			_words[i] |= other._words[i];
+		return *this;
+	}
+	bool operator==(const FacetMask& other) const
+	{
+		for (size_t i = 0; i < Words; ++i) {
+			if (_words[i] != other._words[i])
+				return false;
+		}
+		return true;
+	}
+	bool operator!=(const FacetMask& other) const { return !(*this == other); }
+	size_t hash() const
+	{
+		uint64_t h = 0;
+		for (size_t i = 0; i < Words; ++i)
+			h = (h ^ _words[i]) * 0x9E3779B97F4A7C15ull;
+		return static_cast<size_t>(h ^ (h >> 32));
+	}
+
+private:
+	static const size_t Words = MaxEntityTypes / 64;
+	uint64_t _words[Words] = {};
+};
+
 template <class T>
 using Selector = std::function<bool(std::shared_ptr<T>)>;
 
@@ -134,11 +326,85 @@ private:
 	int64_t _size = 0;
 };
 
+/// @brief Дескриптор элемента SlotMap: номер слота и его поколение.
+struct SlotHandle
+{
+	uint32_t index = UINT32_MAX; /// номер слота
+	uint32_t generation = 0;     /// поколение слота на момент вставки элемента
+
+	bool isNull() const { return index == UINT32_MAX; }
+	bool operator==(const SlotHandle& other) const { return index == other.index && generation == other.generation; }
+	bool operator!=(const SlotHandle& other) const { return !(*this == other); }
+};
+
+/// @brief Контейнер с плотным хранением элементов и стабильными дескрипторами.
+///
+/// Элементы лежат в непрерывном массиве, поэтому перебор - это линейный проход
+/// по памяти. Удаление выполняется за O(1) переносом последнего элемента на место
+/// удаляемого, так что порядок элементов при удалении не сохраняется.
+/// Дескриптор остаётся действительным до удаления своего элемента; освобождённый
+/// слот получает новое поколение, и устаревший дескриптор уже не найдёт в нём
+/// чужой элемент.
+template <class T>
+class SlotMap
+{
+public:
+	/// @brief Добавить элемент в конец плотного массива.
+	SlotHandle insert(const T& value);
+	/// @brief Удалить элемент по дескриптору.
+	bool remove(const SlotHandle& handle);
+	/// @brief Удалить элемент, находящийся в позиции pos плотного массива.
+	void removeAt(int64_t pos);
+	/// @brief Действителен ли дескриптор?
+	bool contains(const SlotHandle& handle) const;
+	/// @brief Получить элемент по дескриптору (nullptr, если дескриптор устарел).
+	T* get(const SlotHandle& handle);
+	const T* get(const SlotHandle& handle) const;
+	/// @brief Получить элемент по его позиции в плотном массиве.
+	T& at(int64_t pos);
+	const T& at(int64_t pos) const;
+	/// @brief Получить дескриптор элемента, находящегося в позиции pos.
+	SlotHandle handleAt(int64_t pos) const;
+	int64_t size() const;
+	bool empty() const;
+	void reserve(size_t n);
+	void clear();
+
+private:
+	struct Slot
+	{
+		uint32_t dense;      /// позиция в плотном массиве (для свободного слота - следующий свободный)
+		uint32_t generation; /// поколение слота
+	};
+
+	std::vector<T> _dense;              /// элементы
+	std::vector<uint32_t> _denseToSlot; /// номер слота для каждого элемента
+	std::vector<Slot> _slots;           /// слоты
+	uint32_t _freeHead = UINT32_MAX;    /// голова списка свободных слотов
+};
+
+using EntitySlots = SlotMap<std::shared_ptr<Entity>>;
+
+/// @brief Лёгкая ссылка на сущность: номер в реестре системы и поколение.
+///
+/// В отличие от shared_ptr, копирование и передача дескриптора не затрагивают
+/// атомарных счётчиков ссылок. Дескриптор удалённой или повторно использованной
+/// сущности становится недействительным (см. System::isValid()).
+struct EntityHandle
+{
+	uint32_t index = UINT32_MAX; /// номер записи в реестре системы
+	uint32_t generation = 0;     /// поколение записи
+
+	bool isNull() const { return index == UINT32_MAX; }
+	bool operator==(const EntityHandle& other) const { return index == other.index && generation == other.generation; }
+	bool operator!=(const EntityHandle& other) const { return !(*this == other); }
+};
+
 /// @brief Итератор списка сущностей.
 class BASIS_EXPORT ListIterator : public Iterator
 {
 public:
-	ListIterator(std::shared_ptr<List<Entity>>& lst);
+	ListIterator(std::shared_ptr<EntitySlots>& lst);
 	ListIterator(const ListIterator&) = delete;
 	ListIterator(ListIterator&&) noexcept;
 	ListIterator& operator=(const ListIterator&) = delete;
@@ -154,15 +420,25 @@ private:
 	void swap(ListIterator&) noexcept;
 
 private:
-	std::shared_ptr<List<Entity>> _list;
-	std::shared_ptr<ListItem<Entity>> _position;
+	std::shared_ptr<EntitySlots> _list;
+	int64_t _position = 0;
+};
+
+/// @brief Условие отбора, принимающее все сущности.
+struct AcceptAll
+{
+	template <class T>
+	bool operator()(const T&) const { return true; }
 };
 
+template <class T, class Pred> class ChildRange;
+
 /// @brief Сущность - базовый класс для всех объектов в системе.
 class BASIS_EXPORT Entity : public std::enable_shared_from_this<Entity>
 {
 	template <class T> friend class Factory;
 	friend class System;
+	friend class Executable;
 	struct Private;
 
 public:
@@ -195,6 +471,21 @@ public:
 	std::shared_ptr<T> addFacet();
 	/// @brief Имеет ли сущность в своем составе грань данного типа?
 	bool hasFacet(tid typeId);
+	/// @brief Имеет ли сущность в своем составе грань данного типа?
+	template<class T>
+	bool hasFacet();
+	/// @brief Получить множество типов граней этой сущности.
+	FacetMask facetMask() const;
+	/// @brief Получить грань данной сущности без передачи владения (nullptr, если грани нет).
+	Entity* facet(tid typeId);
+	template<class T>
+	T* facet();
+	/// @brief Получить дескриптор грани данной сущности (пустой, если грани нет).
+	EntityHandle facetHandle(tid typeId);
+	template<class T>
+	EntityHandle facetHandle();
+	/// @brief Получить дескриптор этой сущности.
+	EntityHandle handle() const;
 	/// @brief Получить ссылку на объект системы.
 	System* system() const;
 	/// @brief Распечатать собственное описание.
@@ -211,14 +502,34 @@ public:
 	/// Вызывается непосредственно перед деструктором сущности.
 	/// Здесь может выполняться освобождение ресурсов, закрытие окон и т.п.
 	virtual void cleanup();
+	/// @brief Подготовка удалённой сущности к повторному использованию.
+	///
+	/// Вызывается, когда удалённая сущность помещается в пул повторного использования
+	/// (см. System::setRecyclePoolSize()). Здесь сущность должна вернуть своё состояние
+	/// к исходному. При повторном использовании сущность получает новый идентификатор,
+	/// после чего вызывается init().
+	virtual void reset();
 	/// @brief Создать новую дочернюю сущность заданного типа.
 	std::shared_ptr<Entity> newEntity(tid typeId);
 	/// @brief Создать новую дочернюю сущность заданного типа.
 	template<class T>
 	std::shared_ptr<T> newEntity();
+	/// @brief Создать сразу n дочерних сущностей заданного типа.
+	///
+	/// Место в списке и индексах резервируется один раз на всю группу, все
+	/// идентификаторы порождаются одним генератором.
+	std::vector<std::shared_ptr<Entity>> newEntities(tid typeId, int64_t n);
+	/// @brief Создать сразу n дочерних сущностей заданного типа.
+	template<class T>
+	std::vector<std::shared_ptr<T>> newEntities(int64_t n);
 	/// @brief Удалить одну конкретную сущность.
+	///
+	/// Во время шага системы удаление (как и deferRemove) выполняется в конце шага,
+	/// чтобы не уничтожить сущность, которая ещё должна выполниться.
 	void removeEntity(const uid& id);
 	/// @brief Удалить все дочерние сущности, удовлетворяющие условию поиска.
+	///
+	/// Во время шага системы удаление выполняется в конце шага.
 	void removeEntities(Selector<Entity> match = nullptr);
 	/// @brief Сколько дочерних сущностей удовлетворяют заданному условию?
 	int64_t entityCount(Selector<Entity> match = nullptr);
@@ -226,21 +537,79 @@ public:
 	///
 	/// @param match условие отбора
 	ListIterator entityIterator(Selector<Entity> match = nullptr);
+	/// @brief Получить диапазон дочерних сущностей типа T для перебора в цикле for.
+	///
+	/// Перебираются дочерние сущности, которые сами имеют тип T или имеют грань
+	/// типа T; элементом диапазона является T&. В отличие от entityIterator(),
+	/// перебор не копирует shared_ptr и не вызывает виртуальных функций, а условие
+	/// отбора - любой вызываемый объект bool(T&), который компилятор может встроить.
+	/// Во время перебора список дочерних сущностей изменять нельзя (используйте
+	/// отложенные изменения).
+	template<class T = Entity>
+	ChildRange<T, AcceptAll> children();
+	template<class T, class Pred>
+	ChildRange<T, Pred> children(Pred match);
+	/// @brief Отложенно создать дочернюю сущность заданного типа.
+	///
+	/// Отложенные изменения накапливаются в буфере вызывающего потока и применяются
+	/// одним проходом в конце шага системы, поэтому их безопасно вызывать из
+	/// исполняемых сущностей, в том числе выполняющихся параллельно.
+	/// @param name имя новой сущности
+	/// @param onCreated вызывается для созданной сущности при применении
+	void deferCreate(tid typeId, const std::string& name = std::string(),
+		std::function<void(std::shared_ptr<Entity>)> onCreated = nullptr);
+	/// @brief Отложенно создать дочернюю сущность заданного типа.
+	template<class T>
+	void deferCreate(const std::string& name = std::string(),
+		std::function<void(std::shared_ptr<Entity>)> onCreated = nullptr);
+	/// @brief Отложенно удалить дочернюю сущность.
+	void deferRemove(const uid& id);
+	/// @brief Отложенно назначить имя данной сущности.
+	void deferRename(const std::string& name);
+	/// @brief Отложенно добавить к данной сущности грань определенного типа.
+	void deferAddFacet(tid typeId);
+	/// @brief Отложенно добавить к данной сущности грань определенного типа.
+	template<class T>
+	void deferAddFacet();
 	/// @brief Найти дочернюю сущность по её уникальному идентификатору.
 	std::shared_ptr<Entity> findEntityById(const uid& id);
+	/// @brief Найти дочернюю сущность по её уникальному идентификатору.
+	EntityHandle findEntityHandle(const uid& id);
 	/// @brief Найти все дочерние сущности с данным именем.
-	std::vector<std::shared_ptr<Entity>> findEntitiesByName(const std::string& name);
+	std::vector<std::shared_ptr<Entity>> findEntitiesByName(boost::string_view name);
+	/// @brief Получить дескрипторы всех дочерних сущностей.
+	std::vector<EntityHandle> entityHandles();
+	/// @brief Удалить дочернюю сущность по дескриптору (во время шага - в конце шага).
+	void removeEntity(EntityHandle handle);
 	/// @brief Ссылка на родителя.
 	Entity* parent() const;
+	/// @brief Ссылка на сущность, гранью которой является данная (nullptr, если это не грань).
+	Entity* owner() const;
 
 	operator bool() const;
 
+protected:
+	// Если идёт шаг системы, отложить action до его конца (false - шаг не идёт).
+	bool deferWhileStepping(std::function<void()> action);
+
 private:
 	void setTypeId(tid typeId);
-	std::shared_ptr<List<Entity>> entities();
+	std::shared_ptr<EntitySlots> entities();
 	void setParent(Entity* parent);
+	// Поместить отложенную команду, адресованную этой сущности, в буфер текущего потока.
+	void defer(int kind, tid typeId, const uid& id, const std::string& name,
+		std::function<void(std::shared_ptr<Entity>)> onCreated);
 	// Обновить индекс имён вложенных сущностей, добавив новую запись или изменив старую, если она есть.
-	void updateNameIndexRecord(std::shared_ptr<Entity> ent, const std::string& name, const std::string& oldName = "");
+	void updateNameIndexRecord(const SlotHandle& slot, const std::string& name, const std::string& oldName = "");
+	// Удалить вложенную сущность вместе с записями индексов.
+	void removeEntity(SlotHandle slot);
+	// Сделать только что созданную сущность вложенной в данную.
+	void adoptEntity(const std::shared_ptr<Entity>& ent);
+	// Принять сразу несколько новых дочерних сущностей: сначала все попадают в
+	// контейнер и индексы, затем для каждой вызывается init().
+	void adoptEntities(const std::vector<std::shared_ptr<Entity>>& ents);
+	// Передать удалённую сущность в пул повторного использования (если он включён).
+	void recycleEntity(std::shared_ptr<Entity> ent);
 
 private:
 	std::unique_ptr<Private> _p;
@@ -249,6 +618,7 @@ private:
 /// @brief Исполняемая сущность.
 class BASIS_EXPORT Executable : public Entity
 {
+	friend class System;
 	struct Private;
 
 public:
@@ -260,22 +630,77 @@ public:
 	/// @brief Установить исполняемую функцию.
 	void setStepFunction(std::function<void()> func);
 	/// @brief Включение/выключение активности данной исполняемой сущности.
+	///
+	/// Во время шага системы изменение откладывается до конца шага. Остальные
+	/// настройки расписания (setPeriod, setPriority и т.п.) можно менять из любого
+	/// потока: они вступают в силу со следующего шага.
 	void setActive(bool active = true);
 	/// @brief Активна ли данная сущность?
 	bool isActive() const;
+	/// @brief Выполнять шаг только в основном потоке.
+	///
+	/// Нужно сущностям, которые работают с окнами и т.п.; остальные исполняемые
+	/// сущности могут выполняться параллельно в рабочих потоках системы.
+	void setMainThreadOnly(bool mainOnly = true);
+	/// @brief Выполняется ли шаг только в основном потоке?
+	bool isMainThreadOnly() const;
+	/// @brief Объявить, что шаг читает грани данного типа.
+	///
+	/// По объявленным множествам чтения и записи система решает, какие исполняемые
+	/// сущности могут выполняться одновременно. Сущности без объявлений ни с кем
+	/// не конфликтуют. Незарегистрированный тип (InvalidTypeId) отвергается.
+	void reads(tid typeId);
+	template<class T> void reads();
+	/// @brief Объявить, что шаг изменяет грани данного типа.
+	void writes(tid typeId);
+	template<class T> void writes();
+	/// @brief Выполнять шаг раньше исполняемых сущностей данного типа.
+	///
+	/// Типом исполняемой сущности считается тип сущности, которой она принадлежит.
+	void runBefore(tid typeId);
+	template<class T> void runBefore();
+	/// @brief Выполнять шаг позже исполняемых сущностей данного типа.
+	void runAfter(tid typeId);
+	template<class T> void runAfter();
+	/// @brief Типы граней, которые читает шаг.
+	FacetMask readSet() const;
+	/// @brief Типы граней, которые изменяет шаг.
+	FacetMask writeSet() const;
+	/// @brief Получить тип, по которому задаётся порядок выполнения (тип владельца).
+	tid executableTypeId() const;
+	/// @brief Выполнять шаг раз в period шагов системы, на шагах с номером phase по модулю period.
+	void setPeriod(uint32_t period, uint32_t phase = 0);
+	/// @brief Получить период выполнения (в шагах системы).
+	uint32_t period() const;
+	/// @brief Получить номер шага внутри периода, на котором выполняется шаг.
+	uint32_t phase() const;
+	/// @brief Установить приоритет: при прочих равных сущности с большим приоритетом выполняются раньше.
+	void setPriority(int priority);
+	/// @brief Получить приоритет.
+	int priority() const;
 	/// @brief Распечатать собственное описание.
 	virtual void print() override;
 
 private:
+	// Включить или выключить немедленно (без откладывания до конца шага).
+	void activate();
+	// dying - вызов из деструктора, владелец грани уже уничтожается
+	void deactivate(bool dying = false);
+
 	std::unique_ptr<Private> _p;
 };
 
 /// @brief Пространственная сущность.
 class BASIS_EXPORT Spatial : public Entity
 {
+	friend class System;
 	struct Private;
 
 public:
+	/// @brief Создать пространственный объект.
+	///
+	/// Данные объекта хранятся в массивах системы; объект без системы (sys == nullptr)
+	/// хранит их сам и не участвует в индексах и пересчёте мировых координат.
 	Spatial(System* sys);
 
 	virtual ~Spatial();
@@ -291,26 +716,190 @@ public:
 	double size() const;
 	/// @brief Установить размер.
 	void setSize(double sz);
+	/// @brief Получить положение в мировой системе координат.
+	///
+	/// Мировые координаты пересчитываются в начале каждого шага (и вызовом
+	/// System::updateWorldTransforms()) только для изменённых поддеревьев; родителем
+	/// считается ближайший предок, имеющий положение в пространстве.
+	point3d worldPosition() const;
+	/// @brief Получить ориентацию в мировой системе координат.
+	point3d worldOrientation() const;
+	/// @brief Получить номер строки объекта в System::spatialView().
+	///
+	/// Номер меняется при уничтожении других пространственных объектов.
+	size_t row() const;
 
 private:
 	std::unique_ptr<Private> _p;
 };
 
+/// @brief Пул блоков одного размера, выделяемых из памяти пачками (слэбами).
+///
+/// Размер блока задаётся первым запросом; освобождённые блоки попадают в список
+/// свободных и выдаются повторно, поэтому при постоянном создании и удалении
+/// объектов общая куча не используется. Запросы другого размера обслуживаются
+/// общей кучей.
+class BASIS_EXPORT SlabPool
+{
+public:
+	explicit SlabPool(size_t blocksPerSlab = 256);
+	~SlabPool();
+	SlabPool(const SlabPool&) = delete;
+	SlabPool& operator=(const SlabPool&) = delete;
+
+	/// @brief Выделить блок заданного размера.
+	void* allocate(size_t size);
+	/// @brief Вернуть блок, выделенный allocate() с тем же размером.
+	void deallocate(void* ptr, size_t size);
+	/// @brief Размер блока (0, пока ничего не выделялось).
+	size_t blockSize() const;
+	/// @brief Число выделенных слэбов.
+	size_t slabCount() const;
+
+private:
+	struct FreeBlock
+	{
+		FreeBlock* next;
+	};
+
+	mutable std::mutex _mutex;
+	size_t _blockSize = 0;
+	size_t _blocksPerSlab;
+	FreeBlock* _free = nullptr;
+	std::vector<void*> _slabs;
+};
+
+/// @brief Аллокатор для std::allocate_shared, берущий память из пула.
+///
+/// Копии аллокатора (в том числе внутри блоков управления shared_ptr) владеют
+/// пулом, поэтому пул живёт, пока жив хотя бы один выделенный из него объект.
+template <class T>
+class PoolAllocator
+{
+public:
+	using value_type = T;
+
+	explicit PoolAllocator(std::shared_ptr<SlabPool> pool) : _pool(std::move(pool)) {}
+	template <class U>
+	PoolAllocator(const PoolAllocator<U>& other) : _pool(other.pool()) {}
+
+	T* allocate(size_t n)
+	{
+		if (n == 1 && alignof(T) <= alignof(std::max_align_t))
+			return static_cast<T*>(_pool->allocate(sizeof(T)));
+		return static_cast<T*>(::operator new(n * sizeof(T)));
+	}
+
+	void deallocate(T* ptr, size_t n)
+	{
+		if (n == 1 && alignof(T) <= alignof(std::max_align_t))
+			_pool->deallocate(ptr, sizeof(T));
+		else
+			::operator delete(ptr);
+	}
+
+	const std::shared_ptr<SlabPool>& pool() const { return _pool; }
+
+private:
+	std::shared_ptr<SlabPool> _pool;
+};
+
+template <class T, class U>
+bool operator==(const PoolAllocator<T>& a, const PoolAllocator<U>& b) { return a.pool() == b.pool(); }
+template <class T, class U>
+bool operator!=(const PoolAllocator<T>& a, const PoolAllocator<U>& b) { return a.pool() != b.pool(); }
+
 /// @brief Публичный интерфейс фабрики сущностей.
 class FactoryInterface
 {
 public:
+	virtual ~FactoryInterface() = default;
 	/// @brief Создать новый экземпляр данной сущности.
 	virtual Entity* newEntity(System*) = 0;
+	/// @brief Создать новый экземпляр данной сущности под управлением shared_ptr.
+	virtual std::shared_ptr<Entity> newSharedEntity(System* sys) { return std::shared_ptr<Entity>(newEntity(sys)); }
 	/// @brief Получить идентификатор типа сущности, порождаемой этой фабрикой.
 	virtual tid typeId() const = 0;
 	/// @brief Получить имя типа сущности, порождаемой этой фабрикой.
 	virtual std::string typeName() const = 0;
 };
 
+/// @brief Архетип - группа сущностей с одинаковым набором граней.
+///
+/// Грани всех сущностей архетипа разложены по столбцам: столбец на каждый тип
+/// из mask (включая собственный тип сущности), строка на каждую сущность.
+/// Столбец - это индекс группировки: в нём лежат указатели на грани, а не их
+/// данные, поэтому перебор избавляет от поиска граней, но не делает обращения к
+/// ним последовательными в памяти (для Spatial такие массивы даёт spatialView()).
+/// Представление действительно до следующего структурного изменения мира.
+struct ArchetypeView
+{
+	FacetMask mask;                      /// набор типов архетипа
+	size_t size = 0;                     /// число сущностей (строк)
+	Entity* const* entities = nullptr;   /// сущности
+	std::vector<Entity* const*> columns; /// столбцы в порядке возрастания идентификатора типа
+
+	/// @brief Получить столбец граней данного типа (nullptr, если его нет).
+	Entity* const* column(tid typeId) const
+	{
+		return mask.test(typeId) ? columns[mask.rank(typeId)] : nullptr;
+	}
+};
+
+/// @brief Пространственные данные всех объектов Spatial системы, разложенные по массивам.
+///
+/// Строка i описывает объект objects[i]. Представление действительно до создания
+/// или уничтожения следующего пространственного объекта. Запись через массивы не
+/// обновляет пространственный индекс (равномерная сетка перестраивается на
+/// каждом шаге сама).
+struct SpatialView
+{
+	size_t size = 0;                    /// число объектов (строк)
+	Spatial* const* objects = nullptr;  /// объекты
+	double* x = nullptr;                /// положение
+	double* y = nullptr;
+	double* z = nullptr;
+	double* orientX = nullptr;          /// ориентация
+	double* orientY = nullptr;
+	double* orientZ = nullptr;
+	double* sizes = nullptr;            /// размеры
+	double* worldX = nullptr;           /// положение в мировой системе координат
+	double* worldY = nullptr;
+	double* worldZ = nullptr;
+
+	/// @brief Массивы положений для пакетной обработки.
+	PointArrays positions() const { return PointArrays{ size, x, y, z }; }
+	/// @brief Массивы ориентаций для пакетной обработки.
+	PointArrays orientations() const { return PointArrays{ size, orientX, orientY, orientZ }; }
+	/// @brief Массивы мировых положений для пакетной обработки.
+	PointArrays worldPositions() const { return PointArrays{ size, worldX, worldY, worldZ }; }
+};
+
+/// @brief Результаты прогона системы без пауз.
+struct RunStats
+{
+	uint64_t ticks = 0;             /// число сделанных шагов
+	double seconds = 0.0;           /// общее время прогона (с)
+	double ticksPerSecond = 0.0;    /// шагов в секунду
+	double meanTickMs = 0.0;        /// среднее время шага (мс)
+	double p99TickMs = 0.0;         /// 99-й процентиль времени шага (мс)
+	uint64_t processed = 0;         /// число выполненных шагов исполняемых сущностей
+	double processedPerSecond = 0.0;/// исполняемых сущностей в секунду
+};
+
+/// @brief Способ порождения идентификаторов сущностей.
+enum class IdMode
+{
+	Random,  /// случайный UUID
+	Compact  /// префикс сеанса (64 бита) и номер сущности в процессе (64 бита)
+};
+
 /// @brief Система - корень мира сущностей.
 class BASIS_EXPORT System : public Entity
 {
+	friend class Entity;
+	friend class Executable;
+	friend class Spatial;
 	struct Private;
 
 public:
@@ -330,6 +919,18 @@ public:
 	int64_t entityTypesCount() const;
 	/// @brief Создать сущность, не добавляя ее в список, не проверяя единственность и т.п.
 	std::shared_ptr<Entity> createEntity(tid typeId);
+	/// @brief Задать размер пула повторного использования для сущностей данного типа.
+	///
+	/// Удалённые сущности этого типа, на которые больше никто не ссылается, не
+	/// уничтожаются, а после вызова reset() хранятся в пуле (не более maxSize штук)
+	/// и выдаются при создании новых сущностей того же типа. Исполняемые грани
+	/// сохранённых сущностей выключаются. Значение 0 выключает пул.
+	void setRecyclePoolSize(tid typeId, size_t maxSize);
+	template<class T> void setRecyclePoolSize(size_t maxSize);
+	/// @brief Получить размер пула повторного использования для сущностей данного типа.
+	size_t recyclePoolSize(tid typeId) const;
+	/// @brief Число сущностей данного типа, ожидающих повторного использования.
+	size_t recycledCount(tid typeId) const;
 	/// @brief Получить имя типа сущности по его идентификатору.
 	std::string typeIdToTypeName(tid typeId) const;
 	/// @brief Корневая выполняемая процедура.
@@ -340,20 +941,129 @@ public:
 	std::shared_ptr<T> createEntity();
 	/// @brief Read and execute commands from external batch file.
 	void executeBatchFile(const std::string& path);
-	/// @brief Слот для приёма команды управления от внешнего источника (например, с консоли).
+	/// @brief Выбрать способ порождения идентификаторов (обычно сразу после запуска).
+	void setIdMode(IdMode mode);
+	/// @brief Получить способ порождения идентификаторов.
+	IdMode idMode() const;
+	/// @brief Породить новый идентификатор сущности (из любого потока).
+	uid newId();
+	/// @brief Получить текстовое представление идентификатора.
+	///
+	/// Компактные идентификаторы этого сеанса выводятся номером сущности.
+	std::string idToString(const uid& id) const;
+	/// @brief Соответствует ли идентификатор тексту, введённому в команде?
+	///
+	/// Случайный UUID задаётся началом своей записи; компактный - номером
+	/// сущности или полной записью.
+	bool idMatches(const uid& id, const std::string& token) const;
+	/// @brief Выполнить команду управления (только из главного цикла).
 	void onCommand(const std::string& command);
+	/// @brief Передать команду управления главному циклу (из любого потока).
+	///
+	/// Команды от консоли и других внешних источников помещаются в очередь без
+	/// блокировок и выполняются главным циклом в начале очередного шага.
+	/// @return false, если очередь команд переполнена и команда отброшена
+	bool postCommand(const std::string& command);
 	/// @brief Pause the main loop.
 	void pause();
 	/// @brief Resume the main loop.
 	void resume();
 	/// @brief Is main loop paused?
 	bool isPaused() const;
+	/// @brief Действителен ли дескриптор (сущность жива и не использована повторно)?
+	bool isValid(EntityHandle handle) const;
+	/// @brief Получить сущность по дескриптору без передачи владения (nullptr, если дескриптор устарел).
+	Entity* entity(EntityHandle handle) const;
+	/// @brief Получить грань типа T сущности по дескриптору без передачи владения.
+	template<class T>
+	T* entity(EntityHandle handle) const;
+	/// @brief Получить владеющую ссылку на сущность по дескриптору.
+	std::shared_ptr<Entity> lock(EntityHandle handle) const;
+	/// @brief Включить или выключить пространственный индекс (R-дерево).
+	///
+	/// В индекс попадают все пространственные объекты системы (сущности Spatial и
+	/// грани Spatial) в виде куба со стороной 2 * size() вокруг position(). Индекс
+	/// обновляется при каждом вызове Spatial::setPosition()/setSize(). Координаты
+	/// берутся как есть, т.е. в системе координат родителя.
+	void setSpatialIndex(bool on);
+	/// @brief Включён ли пространственный индекс?
+	bool spatialIndex() const;
+	/// @brief Найти пространственные объекты, область которых пересекает шар (center, radius).
+	/// @return дескрипторы объектов Spatial (для грани - дескриптор грани)
+	std::vector<EntityHandle> queryRadius(const point3d& center, double radius) const;
+	/// @brief Найти пространственные объекты, область которых пересекает параллелепипед [min, max].
+	std::vector<EntityHandle> queryBox(const point3d& min, const point3d& max) const;
+	/// @brief Найти k пространственных объектов, ближайших к точке.
+	std::vector<EntityHandle> nearest(const point3d& point, size_t k) const;
+	/// @brief Получить массивы положений, ориентаций и размеров всех объектов Spatial.
+	///
+	/// В представление входят и объекты сущностей, ожидающих повторного использования.
+	SpatialView spatialView();
+	/// @brief Пересчитать мировые координаты изменённых объектов немедленно.
+	///
+	/// Нужно после перемещений вне шага; после записи через spatialView() следует
+	/// сначала вызвать invalidateWorldTransforms().
+	void updateWorldTransforms();
+	/// @brief Отметить мировые координаты всех пространственных объектов как устаревшие.
+	void invalidateWorldTransforms();
+	/// @brief Включить или выключить равномерную сетку для поиска пар соседей.
+	///
+	/// Сетка строится по тем же объектам, что и пространственный индекс, но не
+	/// обновляется при каждом перемещении, а перестраивается целиком (параллельно)
+	/// в начале каждого шага. Размер ячейки равен наибольшему диаметру 2 * size()
+	/// или наибольшему радиусу, с которым вызывался forEachNeighborPair()
+	/// (1.0, если оба равны нулю).
+	void setSpatialGrid(bool on);
+	/// @brief Включена ли равномерная сетка?
+	bool spatialGrid() const;
+	/// @brief Перестроить сетку немедленно (например, после перемещений вне шага).
+	void updateSpatialGrid();
+	/// @brief Вызвать func для каждой пары объектов, области которых отстоят друг от друга не более чем на radius.
+	///
+	/// Каждая пара передаётся один раз. Положения берутся на момент последнего
+	/// построения сетки; объекты, появившиеся во время шага, попадают в сетку в
+	/// начале следующего. Создавать и уничтожать пространственные объекты внутри
+	/// func нельзя.
+	void forEachNeighborPair(double radius, const std::function<void(Spatial&, Spatial&)>& func);
 	/// @brief Make n steps forward.
 	void doSteps(uint64_t n = 1);
-	/// @brief Установить задержку между шагами (в мс).
+	/// @brief Сделать n шагов подряд без пауз, задержек и обработки команд.
+	///
+	/// Состояние паузы и темп шагов не учитываются. Должна вызываться из главного
+	/// цикла; команда 'run' лишь передаёт главному циклу запрос на прогон.
+	RunStats run(uint64_t n);
+	/// @brief Вывести результаты прогона.
+	void printRunStats(const RunStats& stats) const;
+	/// @brief Установить период шагов (в мс, 0 - без ограничения).
 	void setDelay(int d);
-	/// @brief Получить текущее значение задержки между шагами (в мс).
+	/// @brief Получить текущее значение периода шагов (в мс).
 	int delay() const;
+	/// @brief Установить целевую частоту шагов (шагов в секунду, 0 - без ограничения).
+	///
+	/// Моменты начала шагов отсчитываются от абсолютного графика, поэтому время
+	/// самого шага не накапливается в виде дрейфа. Если шаг начинается позже своего
+	/// срока более чем на период, это считается перегрузкой, и график сдвигается
+	/// к текущему моменту без попытки наверстать пропущенные шаги.
+	void setTickRate(double rate);
+	/// @brief Получить целевую частоту шагов (шагов в секунду).
+	double tickRate() const;
+	/// @brief Получить число перегрузок (шагов, опоздавших более чем на период).
+	int64_t overrunCount() const;
+	/// @brief Вывести статистику темпа шагов.
+	void printPacingStats() const;
+	/// @brief Установить число потоков, выполняющих шаги (включая основной).
+	void setThreadCount(int n);
+	/// @brief Получить число потоков, выполняющих шаги (включая основной).
+	int threadCount() const;
+	/// @brief Включить или выключить шаг по всему дереву сущностей.
+	///
+	/// По умолчанию выполняются только исполняемые сущности, непосредственно вложенные
+	/// в систему. В иерархическом режиме выполняются все активные исполняемые сущности
+	/// дерева в порядке прямого обхода (родитель раньше вложенных в него сущностей).
+	/// Порядок обхода кэшируется и перестраивается только при изменении дерева.
+	void setHierarchicalStepping(bool on);
+	/// @brief Включён ли шаг по всему дереву сущностей?
+	bool isHierarchicalStepping() const;
 	/// Вывести приветствие на консоль.
 	void printWelcome() const;
 	/// @brief Вывести краткую справку по командам.
@@ -364,12 +1074,41 @@ public:
 	double randomDouble(double from, double to);
 	/// @brief Get steps count passed from start.
 	int64_t stepsFromStart() const;
+	/// @brief Включить/выключить хранение граней по архетипам.
+	///
+	/// В этом режиме все сущности, созданные через newEntity(), группируются по
+	/// набору граней, а addFacet() переносит сущность в другой архетип. Грани
+	/// при этом остаются на своих местах в памяти (см. ArchetypeView).
+	void setArchetypeStorage(bool enable = true);
+	/// @brief Включено ли хранение граней по архетипам?
+	bool archetypeStorage() const;
+	/// @brief Применить все накопленные отложенные изменения.
+	///
+	/// Вызывается автоматически в конце каждого шага.
+	void applyDeferred();
+	/// @brief Получить все архетипы, содержащие грани всех типов из required.
+	std::vector<ArchetypeView> archetypes(const FacetMask& required) const;
+	/// @brief Вызвать func(Entity*, T*...) для каждой сущности, имеющей грани всех типов T.
+	///
+	/// Требует включённого хранения по архетипам; перебор идёт по столбцам архетипов.
+	template<class... T, class Func>
+	void forEach(Func func);
 
 private:
 	System();
 	~System();
 	bool addFactory(FactoryInterface* f);
 	bool removeFactory(tid typeId);
+	/// @brief Поместить сущность в архетип, соответствующий её набору граней.
+	/// @param addedType тип только что добавленной грани (для быстрого перехода между архетипами)
+	void attachToArchetype(Entity* ent, tid addedType = InvalidTypeId);
+	/// @brief Выполнить один шаг всех исполняемых сущностей.
+	/// @return число выполненных шагов исполняемых сущностей
+	uint64_t runTick();
+	/// @brief Исключить сущность из хранилища архетипов.
+	void detachFromArchetype(Entity* ent, bool recursive = false);
+	template<class... T, class Func, size_t... I>
+	static void forEachRow(const ArchetypeView& arch, Func& func, std::index_sequence<I...>);
 
 private:
 	/// @brief Обработка команды 'to'.
@@ -469,22 +1208,306 @@ int64_t List<T>::size() const
 	return _size;
 }
 
+template <class T>
+SlotHandle SlotMap<T>::insert(const T& value)
+{
+	uint32_t index;
+	if (_freeHead != UINT32_MAX) {
+		index = _freeHead;
+		_freeHead = _slots[index].dense;
+	}
+	else {
+		index = static_cast<uint32_t>(_slots.size());
+		_slots.push_back(Slot{ 0, 0 });
+	}
+
+	Slot& slot = _slots[index];
+	slot.dense = static_cast<uint32_t>(_dense.size());
+	_dense.push_back(value);
+	_denseToSlot.push_back(index);
+
+	return SlotHandle{ index, slot.generation };
+}
+
+template <class T>
+bool SlotMap<T>::remove(const SlotHandle& handle)
+{
+	if (!contains(handle))
+		return false;
+
+	Slot& slot = _slots[handle.index];
+	uint32_t pos = slot.dense;
+	// удаляемый элемент уничтожается только после того, как контейнер приведён
+	// в согласованное состояние (деструктор может снова обратиться к нему)
+	T removed = std::move(_dense[pos]);
+	uint32_t last = static_cast<uint32_t>(_dense.size() - 1);
+	if (pos != last) {
+		// переносим последний элемент на место удаляемого
+		_dense[pos] = std::move(_dense[last]);
+		_denseToSlot[pos] = _denseToSlot[last];
+		_slots[_denseToSlot[pos]].dense = pos;
+	}
+	_dense.pop_back();
+	_denseToSlot.pop_back();
+
+	// освобождаем слот; новое поколение делает старые дескрипторы недействительными
+	slot.generation++;
+	slot.dense = _freeHead;
+	_freeHead = handle.index;
+
+	return true;
+}
+
+template <class T>
+void SlotMap<T>::removeAt(int64_t pos)
+{
+	remove(handleAt(pos));
+}
+
+template <class T>
+bool SlotMap<T>::contains(const SlotHandle& handle) const
+{
+	if (handle.index >= _slots.size())
+		return false;
+
+	return (_slots[handle.index].generation == handle.generation);
+}
+
+template <class T>
+T* SlotMap<T>::get(const SlotHandle& handle)
+{
+	if (!contains(handle))
+		return nullptr;
+
+	return &_dense[_slots[handle.index].dense];
+}
+
+template <class T>
+const T* SlotMap<T>::get(const SlotHandle& handle) const
+{
+	if (!contains(handle))
+		return nullptr;
+
+	return &_dense[_slots[handle.index].dense];
+}
+
+template <class T>
+T& SlotMap<T>::at(int64_t pos)
+{
+	return _dense[pos];
+}
+
+template <class T>
+const T& SlotMap<T>::at(int64_t pos) const
+{
+	return _dense[pos];
+}
+
+template <class T>
+SlotHandle SlotMap<T>::handleAt(int64_t pos) const
+{
+	uint32_t index = _denseToSlot[pos];
+	return SlotHandle{ index, _slots[index].generation };
+}
+
+template <class T>
+int64_t SlotMap<T>::size() const
+{
+	return static_cast<int64_t>(_dense.size());
+}
+
+template <class T>
+bool SlotMap<T>::empty() const
+{
+	return _dense.empty();
+}
+
+template <class T>
+void SlotMap<T>::reserve(size_t n)
+{
+	_dense.reserve(n);
+	_denseToSlot.reserve(n);
+	_slots.reserve(n);
+}
+
+template <class T>
+void SlotMap<T>::clear()
+{
+	while (!_dense.empty())
+		removeAt(size() - 1);
+}
+
+/// @brief Привести сущность к типу T.
+///
+/// Если идентификатор типа сущности совпадает с TYPEID(T), сущность создана фабрикой
+/// типа T, поэтому достаточно static_cast; в остальных случаях выполняется dynamic_cast.
+template<class T>
+std::shared_ptr<T> entityCast(const std::shared_ptr<Entity>& ent)
+{
+	if (!ent)
+		return nullptr;
+
+	if (ent->typeId() == TYPEID(T)) {
+		assert(dynamic_cast<T*>(ent.get()) != nullptr);
+		return std::static_pointer_cast<T>(ent);
+	}
+
+	return std::dynamic_pointer_cast<T>(ent);
+}
+
+/// @brief Приведение к типу T без передачи владения (по тем же правилам).
+template<class T>
+T* entityCast(Entity* ent)
+{
+	if (!ent)
+		return nullptr;
+
+	if (ent->typeId() == TYPEID(T)) {
+		assert(dynamic_cast<T*>(ent) != nullptr);
+		return static_cast<T*>(ent);
+	}
+
+	return dynamic_cast<T*>(ent);
+}
+
+template<class T>
+T* Entity::facet()
+{
+	return entityCast<T>(facet(TYPEID(T)));
+}
+
+template<class T>
+EntityHandle Entity::facetHandle()
+{
+	return facetHandle(TYPEID(T));
+}
+
+template<class T>
+T* System::entity(EntityHandle handle) const
+{
+	Entity* ent = entity(handle);
+	return ent ? ent->facet<T>() : nullptr;
+}
+
+/// @brief Получение элемента диапазона ChildRange из дочерней сущности.
+template <class T>
+struct ChildCast
+{
+	static T* cast(Entity* ent) { return ent->facet<T>(); }
+};
+
+template <>
+struct ChildCast<Entity>
+{
+	static Entity* cast(Entity* ent) { return ent; }
+};
+
+/// @brief Диапазон дочерних сущностей типа T, удовлетворяющих условию Pred.
+///
+/// Диапазон удерживает список сущностей одной ссылкой на всё время перебора.
+template <class T, class Pred>
+class ChildRange
+{
+public:
+	class iterator
+	{
+	public:
+		iterator(const ChildRange* range, int64_t pos) : _range(range), _pos(pos) { seek(); }
+
+		T& operator*() const { return *_current; }
+		T* operator->() const { return _current; }
+		iterator& operator++() { ++_pos; seek(); return *this; }
+		bool operator==(const iterator& other) const { return _pos == other._pos; }
+		bool operator!=(const iterator& other) const { return _pos != other._pos; }
+
+	private:
+		// перейти к ближайшей подходящей сущности, начиная с _pos
+		void seek()
+		{
+			const EntitySlots& list = *_range->_list;
+			int64_t size = list.size();
+			for (; _pos < size; ++_pos) {
+				_current = ChildCast<T>::cast(list.at(_pos).get());
+				if (_current && _range->_match(*_current))
+					return;
+			}
+			_pos = size;
+			_current = nullptr;
+		}
+
+		const ChildRange* _range;
+		int64_t _pos;
+		T* _current = nullptr;
+	};
+
+	ChildRange(std::shared_ptr<EntitySlots> list, Pred match) : _list(std::move(list)), _match(std::move(match)) {}
+
+	iterator begin() const { return iterator(this, 0); }
+	iterator end() const { return iterator(this, _list->size()); }
+
+private:
+	std::shared_ptr<EntitySlots> _list;
+	mutable Pred _match;
+};
+
+template<class T>
+ChildRange<T, AcceptAll> Entity::children()
+{
+	return ChildRange<T, AcceptAll>(entities(), AcceptAll());
+}
+
+template<class T, class Pred>
+ChildRange<T, Pred> Entity::children(Pred match)
+{
+	return ChildRange<T, Pred>(entities(), std::move(match));
+}
+
 template<class T>
 std::shared_ptr<T> Entity::as()
 {
-	return std::dynamic_pointer_cast<T>(as(TYPEID(T)));
+	return entityCast<T>(as(TYPEID(T)));
+}
+
+template<class T>
+bool Entity::hasFacet()
+{
+	return hasFacet(TYPEID(T));
 }
 
 template<class T>
 std::shared_ptr<T> Entity::addFacet()
 {
-	return std::dynamic_pointer_cast<T>(addFacet(TYPEID(T)));
+	return entityCast<T>(addFacet(TYPEID(T)));
 }
 
 template<class T>
 std::shared_ptr<T> Entity::newEntity()
 {
-	return std::dynamic_pointer_cast<T>(newEntity(TYPEID(T)));
+	return entityCast<T>(newEntity(TYPEID(T)));
+}
+
+template<class T>
+std::vector<std::shared_ptr<T>> Entity::newEntities(int64_t n)
+{
+	std::vector<std::shared_ptr<T>> result;
+	std::vector<std::shared_ptr<Entity>> created = newEntities(TYPEID(T), n);
+	result.reserve(created.size());
+	for (auto& ent : created)
+		result.push_back(entityCast<T>(ent));
+
+	return result;
+}
+
+template<class T>
+void Entity::deferCreate(const std::string& name, std::function<void(std::shared_ptr<Entity>)> onCreated)
+{
+	deferCreate(TYPEID(T), name, onCreated);
+}
+
+template<class T>
+void Entity::deferAddFacet()
+{
+	deferAddFacet(TYPEID(T));
 }
 
 /// @brief Фабрика сущностей.
@@ -496,6 +1519,8 @@ public:
 	Factory();
 	/// @brief Создать новый экземпляр данной сущности.
 	virtual Entity* newEntity(System* sys) override;
+	/// @brief Создать новый экземпляр данной сущности в пуле этого типа (в одном блоке со счётчиком ссылок).
+	virtual std::shared_ptr<Entity> newSharedEntity(System* sys) override;
 	/// @brief Получить идентификатор типа сущности, порождаемой этой фабрикой.
 	virtual tid typeId() const override;
 	/// @brief Получить имя типа сущности, порождаемой этой фабрикой.
@@ -506,6 +1531,7 @@ protected:
 
 private:
 	std::string _typeName;
+	std::shared_ptr<SlabPool> _pool = std::make_shared<SlabPool>(); /// память под сущности этого типа
 };
 
 template <class T>
@@ -525,6 +1551,16 @@ Entity* Factory<T>::newEntity(System* sys)
 	return ent;
 }
 
+template <class T>
+std::shared_ptr<Entity> Factory<T>::newSharedEntity(System* sys)
+{
+	// объект и блок управления shared_ptr размещаются в одном блоке пула
+	std::shared_ptr<T> ent = std::allocate_shared<T>(PoolAllocator<T>(_pool), sys);
+	ent->setTypeId(TYPEID(T));
+
+	return ent;
+}
+
 template <class T>
 tid Factory<T>::typeId() const
 {
@@ -540,11 +1576,13 @@ std::string Factory<T>::typeName() const
 template<class T>
 std::shared_ptr<T> System::createEntity()
 {
-	return std::dynamic_pointer_cast<T>(createEntity(TYPEID(T)));
+	return entityCast<T>(createEntity(TYPEID(T)));
 }
 
 template<class T> bool System::registerEntity()
 {
+	if (TYPEID(T) == InvalidTypeId)
+		return false;
 	if (isEntityRegistered(TYPEID(T)))
 		return false;
 
@@ -552,6 +1590,11 @@ template<class T> bool System::registerEntity()
 	return addFactory(new Factory<T>());
 }
 
+template<class T> void System::setRecyclePoolSize(size_t maxSize)
+{
+	setRecyclePoolSize(TYPEID(T), maxSize);
+}
+
 template<class T> bool System::unregisterEntity()
 {
 	if (!isEntityRegistered(TYPEID(T)))
@@ -560,6 +1603,50 @@ template<class T> bool System::unregisterEntity()
 	return removeFactory(TYPEID(T));
 }
 
+template<class... T, class Func>
+void System::forEach(Func func)
+{
+	FacetMask required;
+	tid ids[] = { TYPEID(T)... };
+	for (tid typeId : ids)
+		required.set(typeId);
+
+	for (const ArchetypeView& arch : archetypes(required))
+		forEachRow<T...>(arch, func, std::index_sequence_for<T...>());
+}
+
+template<class... T, class Func, size_t... I>
+void System::forEachRow(const ArchetypeView& arch, Func& func, std::index_sequence<I...>)
+{
+	Entity* const* cols[] = { arch.column(TYPEID(T))... };
+	for (size_t row = 0; row < arch.size; ++row)
+		func(arch.entities[row], static_cast<T*>(cols[I][row])...);
+}
+
+template<class T>
+void Executable::reads()
+{
+	reads(TYPEID(T));
+}
+
+template<class T>
+void Executable::writes()
+{
+	writes(TYPEID(T));
+}
+
+template<class T>
+void Executable::runBefore()
+{
+	runBefore(TYPEID(T));
+}
+
+template<class T>
+void Executable::runAfter()
+{
+	runAfter(TYPEID(T));
+}
+
 /// @brief Проверка, что сущность является исполняемой.
 static auto check_executable([](std::shared_ptr<Entity> ent)->bool {
 	if (!ent)
@@ -570,6 +1657,8 @@ static auto check_executable([](std::shared_ptr<Entity> ent)->bool {
 namespace Test {
 	/// @brief Модульные тесты.
 	bool BASIS_EXPORT test();
+	/// @brief Сравнительные замеры производительности (вывод на консоль).
+	void BASIS_EXPORT benchmark();
 
 } // namespace Test
 } // namespace Basis
@@ -2,60 +2,152 @@
 #include "basis_private.h"
 #include <iostream>
 #include <thread>
+#include <cmath>
+#include <algorithm>
+#include <random>
 #include <boost/filesystem.hpp>
 #include <boost/dll.hpp>
 #include <boost/uuid/uuid_generators.hpp>
 #include <boost/uuid/uuid_io.hpp>
 #include <boost/format.hpp>
+#include <boost/function_output_iterator.hpp>
 
 using namespace Basis;
 using namespace std;
 
 namespace fs = boost::filesystem;
+namespace bgi = boost::geometry::index;
 
-point3d Basis::operator+(const point3d& p1, const point3d& p2)
+/// @brief Пространственный объект сущности: сама сущность или её грань Spatial.
+static Spatial* spatialOf(Entity* ent)
 {
-	point3d ret;
-	ret.set<0>(p1.get<0>() + p2.get<0>());
-	ret.set<1>(p1.get<1>() + p2.get<1>());
-	ret.set<2>(p1.get<2>() + p2.get<2>());
-	return ret;
+	Spatial* sp = dynamic_cast<Spatial*>(ent);
+	return sp ? sp : ent->facet<Spatial>();
 }
 
-point3d Basis::operator-(const point3d& p1, const point3d& p2)
+TypeRegistry& TypeRegistry::instance()
 {
-	point3d ret;
-	ret.set<0>(p1.get<0>() - p2.get<0>());
-	ret.set<1>(p1.get<1>() - p2.get<1>());
-	ret.set<2>(p1.get<2>() - p2.get<2>());
-	return ret;
+	static TypeRegistry reg;
+	return reg;
 }
 
-point3d Basis::operator*(const point3d& p, double v)
+tid Basis::typeIdByName(const char* typeName)
 {
-	point3d ret;
-	ret.set<0>(p.get<0>() * v);
-	ret.set<1>(p.get<1>() * v);
-	ret.set<2>(p.get<2>() * v);
-	return ret;
+	TypeRegistry& reg = TypeRegistry::instance();
+	std::lock_guard<std::mutex> lock(reg.mutex);
+
+	auto iter = reg.ids.find(typeName);
+	if (iter != reg.ids.end())
+		return iter->second;
+
+	if (reg.ids.size() >= MaxEntityTypes) {
+		cout << "too many entity types, cannot register: " << typeName << endl;
+		return InvalidTypeId;
+	}
+
+	tid id = reg.ids.size();
+	reg.ids.insert(std::make_pair(std::string(typeName), id));
+
+	return id;
 }
 
-point3d Basis::operator*(double v, const point3d& p)
+const std::shared_ptr<Entity>* FacetSet::find(tid typeId) const
 {
-	point3d ret;
-	ret.set<0>(p.get<0>() * v);
-	ret.set<1>(p.get<1>() * v);
-	ret.set<2>(p.get<2>() * v);
-	return ret;
+	if (!mask.test(typeId))
+		return nullptr;
+
+	size_t pos = mask.rank(typeId);
+	return (count > InlineCapacity) ? &overflow[pos] : &inlineFacets[pos];
+}
+
+void FacetSet::insert(tid typeId, const std::shared_ptr<Entity>& facet)
+{
+	size_t pos = mask.rank(typeId);
+	if (count < InlineCapacity) {
+		for (size_t i = count; i > pos; --i)
+			inlineFacets[i] = std::move(inlineFacets[i - 1]);
+		inlineFacets[pos] = facet;
+	}
+	else {
+		if (count == InlineCapacity) {
+			// встроенный массив заполнен, переносим грани в overflow
+			overflow.reserve(InlineCapacity * 2);
+			for (size_t i = 0; i < InlineCapacity; ++i)
+				overflow.push_back(std::move(inlineFacets[i]));
+		}
+		overflow.insert(overflow.begin() + pos, facet);
+	}
+
+	mask.set(typeId);
+	++count;
+}
+
+SlabPool::SlabPool(size_t blocksPerSlab) : _blocksPerSlab(std::max<size_t>(1, blocksPerSlab))
+{
+}
+
+SlabPool::~SlabPool()
+{
+	for (void* slab : _slabs)
+		::operator delete(slab);
+}
+
+void* SlabPool::allocate(size_t size)
+{
+	// размер блока кратен выравниванию, чтобы соседние блоки были выровнены
+	const size_t align = alignof(std::max_align_t);
+	size_t rounded = std::max((size + align - 1) / align * align, sizeof(FreeBlock));
+
+	lock_guard<mutex> lock(_mutex);
+	if (_blockSize == 0)
+		_blockSize = rounded;
+	if (rounded != _blockSize)
+		return ::operator new(size);
+
+	if (!_free) {
+		char* slab = static_cast<char*>(::operator new(_blockSize * _blocksPerSlab));
+		_slabs.push_back(slab);
+		for (size_t i = _blocksPerSlab; i > 0; --i) {
+			FreeBlock* block = reinterpret_cast<FreeBlock*>(slab + (i - 1) * _blockSize);
+			block->next = _free;
+			_free = block;
+		}
+	}
+
+	FreeBlock* block = _free;
+	_free = block->next;
+	return block;
+}
+
+void SlabPool::deallocate(void* ptr, size_t size)
+{
+	if (!ptr)
+		return;
+
+	const size_t align = alignof(std::max_align_t);
+	size_t rounded = std::max((size + align - 1) / align * align, sizeof(FreeBlock));
+
+	lock_guard<mutex> lock(_mutex);
+	if (rounded != _blockSize) {
+		::operator delete(ptr);
+		return;
+	}
+
+	FreeBlock* block = static_cast<FreeBlock*>(ptr);
+	block->next = _free;
+	_free = block;
 }
 
-double Basis::length(const point3d& v)
+size_t SlabPool::blockSize() const
 {
-	double x = v.get<0>();
-	double y = v.get<1>();
-	double z = v.get<2>();
+	lock_guard<mutex> lock(_mutex);
+	return _blockSize;
+}
 
-	return sqrt(x*x + y*y + z*z);
+size_t SlabPool::slabCount() const
+{
+	lock_guard<mutex> lock(_mutex);
+	return _slabs.size();
 }
 
 void Basis::cutoff(std::string& str, const std::string& what)
@@ -196,11 +288,10 @@ Selector<Entity> Iterator::selector() const
 	return _selector;
 }
 
-ListIterator::ListIterator(std::shared_ptr<List<Entity>>& lst) :
+ListIterator::ListIterator(std::shared_ptr<EntitySlots>& lst) :
 	Iterator(),
 	_list(lst)
 {
-	_position = _list->head();
 }
 
 ListIterator::ListIterator(ListIterator&& src) noexcept :
@@ -218,7 +309,7 @@ ListIterator& ListIterator::operator=(ListIterator&& src) noexcept
 
 bool ListIterator::_finished() const
 {
-	if (_position != nullptr)
+	if (_list && _position < _list->size())
 		return false;
 
 	return true;
@@ -229,7 +320,7 @@ std::shared_ptr<Entity> ListIterator::_value()
 	if (_finished())
 		return nullptr;
 
-	return _position->value();
+	return _list->at(_position);
 }
 
 void ListIterator::_next()
@@ -237,12 +328,12 @@ void ListIterator::_next()
 	if (_finished())
 		return;
 
-	_position = _position->next();
+	++_position;
 }
 
 void ListIterator::_reset()
 {
-	_position = _position->prev();
+	_position = 0;
 }
 
 void ListIterator::swap(ListIterator& other) noexcept
@@ -259,13 +350,16 @@ Entity::Entity()
 Entity::Entity(System* sys) : _p(make_unique<Private>())
 {
 	_p->system_ptr = sys;
-	_p->uuidIndex.clear();
-	_p->nameIndex.clear();
-	_p->entities = std::make_shared<List<Entity>>();
+	_p->entities = std::make_shared<EntitySlots>();
 }
 
 Entity::~Entity()
 {
+	if (_p && _p->archetype && system())
+		system()->detachFromArchetype(this);
+	// сущность может пережить систему, если на неё ссылаются извне
+	if (_p && !_p->handle.isNull() && system() && system()->_p)
+		system()->_p->releaseHandle(this);
 }
 
 bool Entity::isNull() const
@@ -303,41 +397,35 @@ void Entity::setName(const std::string& name)
 	string oldName = _p->name;
 	_p->name = name;
 	Entity* parent = _p->parent;
-	if (parent)
-		parent->updateNameIndexRecord(shared_from_this(), name, oldName);
+	if (parent && oldName != name)
+		parent->updateNameIndexRecord(_p->slot, name, oldName);
 }
 
-void Entity::updateNameIndexRecord(std::shared_ptr<Entity> ent, const std::string& name, const std::string& oldName)
+void Entity::updateNameIndexRecord(const SlotHandle& slot, const std::string& name, const std::string& oldName)
 {
 	// если в индексе есть этот же элемент под старым именем, удаляем его:
-	if (!oldName.empty() && oldName != name) {
-		pair<multimap<string, std::shared_ptr<Entity>>::iterator,
-			multimap<string, std::shared_ptr<Entity>>::iterator> itRange =
-			_p->nameIndex.equal_range(oldName);
-
-		auto it = itRange.first;
-		while (it != itRange.second) {
-			if (it->second == ent)
-				it = _p->nameIndex.erase(it);
-			else
-				++it;
-		}
-	}
+	if (!oldName.empty())
+		_p->nameIndex.erase(oldName, slot);
 
-	_p->nameIndex.insert(std::make_pair(name, ent));
+	// безымянные сущности в индекс не попадают
+	if (!name.empty())
+		_p->nameIndex.insert(name, slot);
 }
 
 shared_ptr<Entity> Entity::addFacet(tid typeId)
 {
-	auto iter = _p->facets.find(typeId);
-	if (iter != _p->facets.end())
-		return iter->second; // такая грань уже есть
+	auto facet = _p->facets.find(typeId);
+	if (facet)
+		return *facet; // такая грань уже есть
 
 	auto newFacet = system()->createEntity(typeId);
 	if (!newFacet)
 		return nullptr;
 
-	_p->facets.insert(std::make_pair<>(typeId, newFacet));
+	newFacet->_p->owner = this;
+	_p->facets.insert(typeId, newFacet);
+	if (_p->archetype)
+		system()->attachToArchetype(this, typeId);
 
 	return newFacet;
 }
@@ -347,20 +435,44 @@ shared_ptr<Entity> Entity::as(tid typeId)
 	if (typeId == _p->typeId)
 		return shared_from_this();
 
-	auto iter = _p->facets.find(typeId);
-	if (iter != _p->facets.end())
-		return iter->second;
+	auto facet = _p->facets.find(typeId);
+	if (facet)
+		return *facet;
 
 	return nullptr;
 }
 
+Entity* Entity::facet(tid typeId)
+{
+	if (typeId == _p->typeId)
+		return this;
+
+	auto facet = _p->facets.find(typeId);
+	if (facet)
+		return facet->get();
+
+	return nullptr;
+}
+
+EntityHandle Entity::facetHandle(tid typeId)
+{
+	Entity* ent = facet(typeId);
+	return ent ? ent->_p->handle : EntityHandle();
+}
+
+EntityHandle Entity::handle() const
+{
+	return _p->handle;
+}
+
 bool Entity::hasFacet(tid typeId)
 {
-	auto iter = _p->facets.find(typeId);
-	if (iter != _p->facets.end())
-		return true;
+	return _p->facets.mask.test(typeId);
+}
 
-	return false;
+FacetMask Entity::facetMask() const
+{
+	return _p->facets.mask;
 }
 
 System* Entity::system() const
@@ -371,13 +483,13 @@ System* Entity::system() const
 void Entity::print()
 {
 	std::cout << "-> entity" << endl;
-	std::cout << "id: " << _p->id << endl;
+	std::cout << "id: " << system()->idToString(_p->id) << endl;
 	std::cout << "-> facets" << endl;
-	for (auto fac : _p->facets) {
+	_p->facets.forEach([](const std::shared_ptr<Entity>& fac) {
 		std::cout << "-> facet" << endl;
-		fac.second->print();
+		fac->print();
 		std::cout << "<- facet" << endl;
-	}
+	});
 	std::cout << "<- facets" << endl;
 	std::cout << "<- entity" << endl;
 }
@@ -395,6 +507,10 @@ void Entity::cleanup()
 {
 }
 
+void Entity::reset()
+{
+}
+
 Executable::Executable(System* sys) :
 	Entity(sys),
 	_p(make_unique<Private>())
@@ -403,6 +519,8 @@ Executable::Executable(System* sys) :
 
 Executable::~Executable()
 {
+	// из деструктора откладывать нельзя: объекта к концу шага уже не будет
+	deactivate(true);
 }
 
 void Executable::step()
@@ -418,7 +536,54 @@ void Executable::setStepFunction(std::function<void()> func)
 
 void Executable::setActive(bool active)
 {
-	_p->active = active;
+	if (_p->active == active)
+		return;
+
+	if (deferWhileStepping([this, active] { setActive(active); }))
+		return;
+
+	if (active)
+		activate();
+	else
+		deactivate();
+}
+
+void Executable::activate()
+{
+	lock_guard<mutex> lock(system()->_p->scheduleMutex);
+	if (_p->active)
+		return;
+
+	_p->active = true;
+	system()->_p->scheduleDirty = true;
+	Entity* ent = owner() ? owner() : this;
+	ent->Entity::_p->activeExecutables++;
+	std::vector<Executable*>& registry = system()->_p->activeExecutables;
+	_p->activeIndex = static_cast<int64_t>(registry.size());
+	registry.push_back(this);
+}
+
+void Executable::deactivate(bool dying)
+{
+	if (!system() || !system()->_p)
+		return;
+
+	lock_guard<mutex> lock(system()->_p->scheduleMutex);
+	if (!_p->active)
+		return;
+
+	_p->active = false;
+	system()->_p->scheduleDirty = true;
+	// владелец умирающей грани сам уничтожается, его счётчик уже не нужен
+	if (!dying || !owner())
+		(owner() ? owner() : this)->Entity::_p->activeExecutables--;
+	std::vector<Executable*>& registry = system()->_p->activeExecutables;
+	// на освободившееся место переносим последний элемент реестра
+	Executable* last = registry.back();
+	registry[_p->activeIndex] = last;
+	last->_p->activeIndex = _p->activeIndex;
+	registry.pop_back();
+	_p->activeIndex = -1;
 }
 
 bool Executable::isActive() const
@@ -426,6 +591,103 @@ bool Executable::isActive() const
 	return _p->active;
 }
 
+void Executable::setMainThreadOnly(bool mainOnly)
+{
+	lock_guard<mutex> lock(system()->_p->scheduleMutex);
+	_p->mainThreadOnly = mainOnly;
+	system()->_p->scheduleDirty = true;
+}
+
+bool Executable::isMainThreadOnly() const
+{
+	return _p->mainThreadOnly;
+}
+
+void Executable::reads(tid typeId)
+{
+	if (typeId == InvalidTypeId || typeId >= MaxEntityTypes) {
+		cout << "reads: invalid type id " << typeId << endl;
+		return;
+	}
+
+	lock_guard<mutex> lock(system()->_p->scheduleMutex);
+	_p->readSet.set(typeId);
+	system()->_p->scheduleDirty = true;
+}
+
+void Executable::writes(tid typeId)
+{
+	if (typeId == InvalidTypeId || typeId >= MaxEntityTypes) {
+		cout << "writes: invalid type id " << typeId << endl;
+		return;
+	}
+
+	lock_guard<mutex> lock(system()->_p->scheduleMutex);
+	_p->writeSet.set(typeId);
+	system()->_p->scheduleDirty = true;
+}
+
+void Executable::runBefore(tid typeId)
+{
+	lock_guard<mutex> lock(system()->_p->scheduleMutex);
+	_p->before.push_back(typeId);
+	system()->_p->scheduleDirty = true;
+}
+
+void Executable::runAfter(tid typeId)
+{
+	lock_guard<mutex> lock(system()->_p->scheduleMutex);
+	_p->after.push_back(typeId);
+	system()->_p->scheduleDirty = true;
+}
+
+FacetMask Executable::readSet() const
+{
+	return _p->readSet;
+}
+
+FacetMask Executable::writeSet() const
+{
+	return _p->writeSet;
+}
+
+tid Executable::executableTypeId() const
+{
+	return owner() ? owner()->typeId() : typeId();
+}
+
+void Executable::setPeriod(uint32_t period, uint32_t phase)
+{
+	lock_guard<mutex> lock(system()->_p->scheduleMutex);
+	if (period == 0)
+		period = 1;
+	_p->period = period;
+	_p->phase = phase % period;
+	system()->_p->scheduleDirty = true;
+}
+
+uint32_t Executable::period() const
+{
+	return _p->period;
+}
+
+uint32_t Executable::phase() const
+{
+	return _p->phase;
+}
+
+void Executable::setPriority(int priority)
+{
+	lock_guard<mutex> lock(system()->_p->scheduleMutex);
+	_p->priority = priority;
+	system()->_p->scheduleDirty = true;
+}
+
+int Executable::priority() const
+{
+	return _p->priority;
+}
+
 void Executable::print()
 {
 	Entity::print();
@@ -433,7 +695,7 @@ void Executable::print()
 	std::cout << "[Executable]" << endl;
 }
 
-std::shared_ptr<List<Entity>> Entity::entities()
+std::shared_ptr<EntitySlots> Entity::entities()
 {
 	return _p->entities;
 }
@@ -444,20 +706,79 @@ shared_ptr<Entity> Entity::newEntity(tid typeId)
 	if (!ent)
 		return nullptr;
 
+	adoptEntity(ent);
+
+	return ent;
+}
+
+std::vector<std::shared_ptr<Entity>> Entity::newEntities(tid typeId, int64_t n)
+{
+	vector<shared_ptr<Entity>> result;
+	if (n <= 0 || typeId >= system()->_p->factories.size())
+		return result;
+
+	FactoryInterface* factory = system()->_p->factories[typeId].get();
+	if (!factory)
+		return result;
+
+	result.reserve(n);
+	for (int64_t i = 0; i < n; ++i) {
+		shared_ptr<Entity> ent = system()->createEntity(typeId);
+		if (ent)
+			result.push_back(ent);
+	}
+	adoptEntities(result);
+
+	return result;
+}
+
+void Entity::adoptEntities(const std::vector<std::shared_ptr<Entity>>& ents)
+{
+	_p->entities->reserve(_p->entities->size() + ents.size());
+	_p->uuidIndex.reserve(_p->uuidIndex.size() + ents.size());
+
+	for (const auto& ent : ents) {
+		ent->setParent(this);
+		ent->_p->slot = _p->entities->insert(ent);
+		_p->uuidIndex.insert(ent->id(), ent->_p->slot);
+		if (!ent->name().empty())
+			_p->nameIndex.insert(ent->name(), ent->_p->slot);
+	}
+
+	if (system()->archetypeStorage()) {
+		for (const auto& ent : ents)
+			system()->attachToArchetype(ent.get());
+	}
+
+	for (const auto& ent : ents)
+		ent->init();
+}
+
+void Entity::adoptEntity(const std::shared_ptr<Entity>& ent)
+{
 	ent->setParent(this);
 
-	auto iter = _p->entities->pushBack(ent);
+	ent->_p->slot = _p->entities->insert(ent);
 	// добавляем элемент в uuid-индекс
-	_p->uuidIndex.insert(std::make_pair(ent->id(), iter));
+	_p->uuidIndex.insert(ent->id(), ent->_p->slot);
+	if (!ent->name().empty())
+		_p->nameIndex.insert(ent->name(), ent->_p->slot);
 
-	ent->init();
+	if (system()->archetypeStorage())
+		system()->attachToArchetype(ent.get());
 
-	return ent;
+	ent->init();
 }
 
 void Entity::setParent(Entity* parent)
 {
 	_p->parent = parent;
+	// от родителя зависит, выполняется ли сущность; фазы перестраиваем, только
+	// если переносятся активные исполняемые сущности
+	if (system()->_p->hasActiveExecutables(this))
+		system()->_p->scheduleDirty = true;
+	// и где она находится в мировой системе координат
+	system()->_p->markWorldDirty(spatialOf(this));
 }
 
 Entity* Entity::parent() const
@@ -465,41 +786,195 @@ Entity* Entity::parent() const
 	return _p->parent;
 }
 
-void Entity::removeEntities(Selector<Entity> match)
+Entity* Entity::owner() const
+{
+	return _p->owner;
+}
+
+void Entity::deferCreate(tid typeId, const std::string& name, std::function<void(std::shared_ptr<Entity>)> onCreated)
+{
+	defer(DeferredCommand::Create, typeId, uid(), name, onCreated);
+}
+
+void Entity::deferRemove(const uid& id)
+{
+	defer(DeferredCommand::Remove, InvalidTypeId, id, std::string(), nullptr);
+}
+
+void Entity::deferRename(const std::string& name)
+{
+	defer(DeferredCommand::Rename, InvalidTypeId, uid(), name, nullptr);
+}
+
+void Entity::deferAddFacet(tid typeId)
+{
+	defer(DeferredCommand::AddFacet, typeId, uid(), std::string(), nullptr);
+}
+
+void Entity::defer(int kind, tid typeId, const uid& id, const std::string& name,
+	std::function<void(std::shared_ptr<Entity>)> onCreated)
+{
+	DeferredCommand cmd;
+	cmd.kind = static_cast<DeferredCommand::Kind>(kind);
+	// система не принадлежит ни одному shared_ptr, на неё храним прямую ссылку
+	if (this == system())
+		cmd.target = this;
+	else
+		cmd.weak = shared_from_this();
+	cmd.typeId = typeId;
+	cmd.id = id;
+	cmd.name = name;
+	cmd.onCreated = onCreated;
+
+	CommandBuffer* buffer = system()->_p->threadBuffer();
+	lock_guard<mutex> lock(buffer->mutex);
+	buffer->commands.push_back(std::move(cmd));
+}
+
+bool Entity::deferWhileStepping(std::function<void()> action)
 {
-	auto item = _p->entities->head();
-	while (item) {
-		if (!match) {
-			item = _p->entities->remove(item);
+	System* sys = system();
+	if (!sys || !sys->_p || !sys->_p->stepping.load(memory_order_acquire))
+		return false;
+
+	DeferredCommand cmd;
+	cmd.kind = DeferredCommand::Call;
+	// адресат проверяется при применении: удалённой сущности вызов не нужен
+	if (this == sys) {
+		cmd.target = this;
+	}
+	else {
+		try {
+			cmd.weak = shared_from_this();
 		}
-		else {
-			if (match(item->value()))
-				item = _p->entities->remove(item);
-			else
-				item = item->next();
+		catch (const std::bad_weak_ptr&) {
+			// сущность ещё создаётся и никому не принадлежит, поэтому в фазах её нет
+			return false;
 		}
 	}
+	cmd.action = std::move(action);
+
+	CommandBuffer* buffer = sys->_p->threadBuffer();
+	lock_guard<mutex> lock(buffer->mutex);
+	buffer->commands.push_back(std::move(cmd));
+	return true;
 }
 
-void Entity::removeEntity(const uid& id)
+void Entity::removeEntities(Selector<Entity> match)
 {
-	auto iter = _p->uuidIndex.find(id);
-	if (iter != _p->uuidIndex.end()) {
-		_p->entities->remove(iter->second);
+	if (deferWhileStepping([this, match] { removeEntities(match); }))
+		return;
+
+	if (!match) {
+		vector<shared_ptr<Entity>> removed;
+		if (system()->_p->recycling)
+			removed.reserve(_p->entities->size());
+
+		for (int64_t pos = 0; pos < _p->entities->size(); ++pos) {
+			Entity* ent = _p->entities->at(pos).get();
+			ent->setParent(nullptr);
+			if (system()->archetypeStorage())
+				system()->detachFromArchetype(ent, true);
+			if (system()->_p->recycling)
+				removed.push_back(_p->entities->at(pos));
+		}
+		_p->uuidIndex.clear();
+		_p->nameIndex.clear();
+		_p->entities->clear();
+
+		for (auto& ent : removed)
+			recycleEntity(std::move(ent));
+		return;
+	}
+
+	// на место удалённого элемента встаёт последний, поэтому позицию
+	// продвигаем только если текущий элемент остался на месте
+	int64_t pos = 0;
+	while (pos < _p->entities->size()) {
+		if (match(_p->entities->at(pos)))
+			removeEntity(_p->entities->handleAt(pos));
+		else
+			++pos;
 	}
 }
 
+void Entity::removeEntity(const uid& id)
+{
+	if (deferWhileStepping([this, id] { removeEntity(id); }))
+		return;
+
+	SlotHandle* slot = _p->uuidIndex.find(id);
+	if (slot)
+		removeEntity(*slot);
+}
+
+void Entity::removeEntity(SlotHandle slot)
+{
+	auto ent = _p->entities->get(slot);
+	if (!ent)
+		return;
+
+	_p->uuidIndex.erase((*ent)->id(), slot);
+	if (!(*ent)->name().empty())
+		_p->nameIndex.erase((*ent)->name(), slot);
+
+	// удалённая сущность больше не должна обновлять индексы бывшего родителя
+	(*ent)->setParent(nullptr);
+	if (system()->archetypeStorage())
+		system()->detachFromArchetype(ent->get(), true);
+	shared_ptr<Entity> removed;
+	if (system()->_p->recycling)
+		removed = *ent;
+	_p->entities->remove(slot);
+
+	if (removed)
+		recycleEntity(std::move(removed));
+}
+
+void Entity::recycleEntity(std::shared_ptr<Entity> ent)
+{
+	// сущность, на которую ещё кто-то ссылается, повторно использовать нельзя
+	if (ent.use_count() != 1)
+		return;
+
+	std::vector<RecyclePool>& pools = system()->_p->recyclePools;
+	tid typeId = ent->typeId();
+	if (typeId >= pools.size() || pools[typeId].entities.size() >= pools[typeId].maxSize)
+		return;
+
+	// сохранённая сущность не должна выполняться
+	Executable* exe = dynamic_cast<Executable*>(ent.get());
+	if (exe)
+		exe->setActive(false);
+	auto facet = ent->as<Executable>();
+	if (facet)
+		facet->setActive(false);
+
+	ent->removeEntities();
+	ent->_p->name.clear();
+	ent->reset();
+	// старые дескрипторы (в том числе дескрипторы граней) не должны указывать
+	// на повторно использованную сущность
+	system()->_p->unindexSpatial(spatialOf(ent.get()));
+	ent->_p->facets.forEach([this](const std::shared_ptr<Entity>& fac) {
+		system()->_p->releaseHandle(fac.get());
+	});
+	system()->_p->releaseHandle(ent.get());
+
+	// вложенные сущности того же типа могли занять последние места в пуле
+	if (pools[typeId].entities.size() < pools[typeId].maxSize)
+		pools[typeId].entities.push_back(std::move(ent));
+}
+
 int64_t Entity::entityCount(Selector<Entity> match)
 {
 	if (!match)
 		return _p->entities->size();
 
 	int64_t count = 0;
-	auto item = _p->entities->head();
-	while (item) {
-		if (match(item->value()))
+	for (int64_t pos = 0; pos < _p->entities->size(); ++pos) {
+		if (match(_p->entities->at(pos)))
 			++count;
-		item = item->next();
 	}
 
 	return count;
@@ -514,24 +989,58 @@ ListIterator Entity::entityIterator(Selector<Entity> match)
 	return std::move(iter);
 }
 
+EntityHandle Entity::findEntityHandle(const uid& id)
+{
+	SlotHandle* slot = _p->uuidIndex.find(id);
+	if (slot) {
+		auto ent = _p->entities->get(*slot);
+		if (ent)
+			return (*ent)->_p->handle;
+	}
+
+	return EntityHandle();
+}
+
+std::vector<EntityHandle> Entity::entityHandles()
+{
+	vector<EntityHandle> result;
+	result.reserve(_p->entities->size());
+	for (int64_t pos = 0; pos < _p->entities->size(); ++pos)
+		result.push_back(_p->entities->at(pos)->_p->handle);
+
+	return result;
+}
+
+void Entity::removeEntity(EntityHandle handle)
+{
+	if (deferWhileStepping([this, handle] { removeEntity(handle); }))
+		return;
+
+	Entity* ent = system()->entity(handle);
+	if (ent && ent->parent() == this)
+		removeEntity(ent->_p->slot);
+}
+
 std::shared_ptr<Entity> Entity::findEntityById(const uid& id)
 {
-	auto iter = _p->uuidIndex.find(id);
-	if (iter != _p->uuidIndex.end())
-		return iter->second->value();
+	SlotHandle* slot = _p->uuidIndex.find(id);
+	if (slot) {
+		auto ent = _p->entities->get(*slot);
+		if (ent)
+			return *ent;
+	}
 
 	return nullptr;
 }
 
-std::vector<std::shared_ptr<Entity>> Entity::findEntitiesByName(const std::string& name)
+std::vector<std::shared_ptr<Entity>> Entity::findEntitiesByName(boost::string_view name)
 {
 	vector<shared_ptr<Entity>> res;
-	pair<multimap<string, std::shared_ptr<Entity>>::iterator,
-		multimap<string, std::shared_ptr<Entity>>::iterator> itRange =
-		_p->nameIndex.equal_range(name);
-
-	for (auto it = itRange.first; it != itRange.second; ++it)
-		res.push_back(it->second);
+	_p->nameIndex.forEach(name, [&](const SlotHandle& slot) {
+		auto ent = _p->entities->get(slot);
+		if (ent)
+			res.push_back(*ent);
+	});
 
 	return res;
 }
@@ -545,40 +1054,172 @@ Spatial::Spatial(System* sys) :
 	Entity(sys),
 	_p(make_unique<Private>())
 {
+	if (sys) {
+		_p->store = &sys->_p->spatials;
+	}
+	else {
+		_p->ownStore = make_unique<SpatialStore>();
+		_p->store = _p->ownStore.get();
+	}
+	_p->row = _p->store->add(this);
+	if (sys)
+		sys->_p->markWorldDirty(this);
 }
 
 Spatial::~Spatial()
 {
+	// у объекта вне системы (или пережившего её) эти флаги сброшены
+	if (_p->indexed || _p->gridSlot >= 0)
+		system()->_p->unindexSpatial(this);
+
+	if (_p->worldDirty)
+		system()->_p->unmarkWorldDirty(this);
+
+	Spatial* moved = _p->store->remove(_p->row);
+	if (moved)
+		moved->_p->row = _p->row;
 }
 
 point3d Spatial::position() const
 {
-	return _p->position;
+	const SpatialStore& s = *_p->store;
+	size_t i = _p->row;
+	return point3d(s.x[i], s.y[i], s.z[i]);
 }
 
 void Spatial::setPosition(const point3d& pos)
 {
-	_p->position = pos;
+	SpatialStore& s = *_p->store;
+	size_t i = _p->row;
+	s.x[i] = bg::get<0>(pos);
+	s.y[i] = bg::get<1>(pos);
+	s.z[i] = bg::get<2>(pos);
+	// повторные перемещения до пересчёта обходятся без обращения к списку
+	if (!_p->worldDirty.load(memory_order_relaxed) && system())
+		system()->_p->markWorldDirty(this);
+	if (_p->indexed)
+		system()->_p->updateSpatial(this);
 }
 
 point3d Spatial::orientation() const
 {
-	return _p->orientation;
+	const SpatialStore& s = *_p->store;
+	size_t i = _p->row;
+	return point3d(s.orientX[i], s.orientY[i], s.orientZ[i]);
 }
 
 void Spatial::setOrientation(const point3d& orient)
 {
-	_p->orientation = orient;
+	SpatialStore& s = *_p->store;
+	size_t i = _p->row;
+	s.orientX[i] = bg::get<0>(orient);
+	s.orientY[i] = bg::get<1>(orient);
+	s.orientZ[i] = bg::get<2>(orient);
+	if (!_p->worldDirty.load(memory_order_relaxed) && system())
+		system()->_p->markWorldDirty(this);
 }
 
 double Spatial::size() const
 {
-	return _p->size;
+	return _p->store->size[_p->row];
 }
 
 void Spatial::setSize(double sz)
 {
-	_p->size = sz;
+	_p->store->size[_p->row] = sz;
+	if (_p->indexed)
+		system()->_p->updateSpatial(this);
+}
+
+point3d Spatial::worldPosition() const
+{
+	// у объекта вне системы нет родителя
+	if (!system())
+		return position();
+
+	const SpatialStore& s = *_p->store;
+	size_t i = _p->row;
+	return point3d(s.worldX[i], s.worldY[i], s.worldZ[i]);
+}
+
+point3d Spatial::worldOrientation() const
+{
+	if (!system())
+		return orientation();
+
+	const SpatialStore& s = *_p->store;
+	size_t i = _p->row;
+	return point3d(s.worldOrientX[i], s.worldOrientY[i], s.worldOrientZ[i]);
+}
+
+size_t Spatial::row() const
+{
+	return _p->row;
+}
+
+size_t SpatialStore::add(Spatial* sp)
+{
+	lock_guard<std::mutex> lock(mutex);
+	objects.push_back(sp);
+	x.push_back(0.0);
+	y.push_back(0.0);
+	z.push_back(0.0);
+	orientX.push_back(0.0);
+	orientY.push_back(0.0);
+	orientZ.push_back(0.0);
+	size.push_back(0.0);
+	worldX.push_back(0.0);
+	worldY.push_back(0.0);
+	worldZ.push_back(0.0);
+	worldOrientX.push_back(0.0);
+	worldOrientY.push_back(0.0);
+	worldOrientZ.push_back(0.0);
+	return objects.size() - 1;
+}
+
+Spatial* SpatialStore::remove(size_t row)
+{
+	lock_guard<std::mutex> lock(mutex);
+	size_t last = objects.size() - 1;
+	Spatial* moved = nullptr;
+	if (row != last) {
+		moved = objects[last];
+		objects[row] = moved;
+		assignRow(row, *this, last);
+	}
+
+	objects.pop_back();
+	x.pop_back();
+	y.pop_back();
+	z.pop_back();
+	orientX.pop_back();
+	orientY.pop_back();
+	orientZ.pop_back();
+	size.pop_back();
+	worldX.pop_back();
+	worldY.pop_back();
+	worldZ.pop_back();
+	worldOrientX.pop_back();
+	worldOrientY.pop_back();
+	worldOrientZ.pop_back();
+	return moved;
+}
+
+void SpatialStore::assignRow(size_t row, const SpatialStore& from, size_t fromRow)
+{
+	x[row] = from.x[fromRow];
+	y[row] = from.y[fromRow];
+	z[row] = from.z[fromRow];
+	orientX[row] = from.orientX[fromRow];
+	orientY[row] = from.orientY[fromRow];
+	orientZ[row] = from.orientZ[fromRow];
+	size[row] = from.size[fromRow];
+	worldX[row] = from.worldX[fromRow];
+	worldY[row] = from.worldY[fromRow];
+	worldZ[row] = from.worldZ[fromRow];
+	worldOrientX[row] = from.worldOrientX[fromRow];
+	worldOrientY[row] = from.worldOrientY[fromRow];
+	worldOrientZ[row] = from.worldOrientZ[fromRow];
 }
 
 System* System::instance()
@@ -589,6 +1230,15 @@ System* System::instance()
 
 System::System() : Entity(this), _p(new Private())
 {
+	// префикс отличает компактные идентификаторы разных запусков
+	std::random_device rd;
+	_p->sessionPrefix = (static_cast<uint64_t>(rd()) << 32) | rd();
+
+	_p->registerHandle(this);
+	// общий буфер отложенных изменений; буферы рабочих потоков добавляет setThreadCount()
+	_p->buffers.push_back(make_unique<CommandBuffer>());
+	_p->dirtyLists.push_back(make_unique<DirtyList>());
+
 	// регистрация системных сущностей
 	registerEntity<Entity>();
 	registerEntity<Executable>();
@@ -597,6 +1247,30 @@ System::System() : Entity(this), _p(new Private())
 
 System::~System()
 {
+	// дочерние сущности обращаются к данным системы при удалении
+	_p->recycling = false;
+	_p->recyclePools.clear();
+	removeEntities();
+	_p->releaseHandle(this);
+	// сущности, на которые ещё ссылаются извне, переживут систему: их дескрипторы
+	// и ссылки на систему обнуляются, чтобы деструкторы не обращались к её данным
+	for (int64_t pos = 0; pos < _p->handles.size(); ++pos) {
+		Entity* ent = _p->handles.at(pos);
+		ent->_p->handle = EntityHandle();
+		ent->_p->system_ptr = nullptr;
+	}
+	// их пространственные данные переносятся в собственные хранилища
+	for (Spatial* sp : _p->spatials.objects) {
+		auto own = make_unique<SpatialStore>();
+		own->add(sp);
+		own->assignRow(0, _p->spatials, sp->_p->row);
+		sp->_p->indexed = false;
+		sp->_p->gridSlot = -1;
+		sp->_p->worldDirty = false;
+		sp->_p->store = own.get();
+		sp->_p->row = 0;
+		sp->_p->ownStore = std::move(own);
+	}
 	delete _p;
 	_p = nullptr;
 }
@@ -634,7 +1308,7 @@ int System::loadModules(const string& path, bool recursive)
 
 bool System::isEntityRegistered(tid typeId) const
 {
-	if (_p->factories.count(typeId) > 0)
+	if (typeId < _p->factories.size() && _p->factories[typeId])
 		return true;
 
 	return false;
@@ -642,22 +1316,35 @@ bool System::isEntityRegistered(tid typeId) const
 
 int64_t System::entityTypesCount() const
 {
-	return _p->factories.size();
+	return _p->factoriesCount;
 }
 
 bool System::addFactory(FactoryInterface* f)
 {
-	_p->factories[f->typeId()] = std::shared_ptr<FactoryInterface>(f);
+	tid typeId = f->typeId();
+	if (typeId >= MaxEntityTypes) {
+		delete f;
+		return false;
+	}
+
+	if (typeId >= _p->factories.size())
+		_p->factories.resize(typeId + 1);
+	if (!_p->factories[typeId])
+		_p->factoriesCount++;
+	_p->factories[typeId] = std::shared_ptr<FactoryInterface>(f);
 
 	return true;
 }
 
 bool System::removeFactory(tid typeId)
 {
-	_p->factories.erase(typeId);
+	if (!isEntityRegistered(typeId))
+		return true;
+
+	_p->factories[typeId] = nullptr;
+	_p->factoriesCount--;
+	setRecyclePoolSize(typeId, 0);
 
-	if (_p->factories.find(typeId) != _p->factories.end())
-		return false;
 	return true;
 }
 
@@ -721,12 +1408,8 @@ void System::onCommand_to(const std::string& command)
 			if (ent->name() == token) { // по имени
 				selected = true;
 			}
-			else {
-				// по UUID
-				std::string str = boost::uuids::to_string(ent->id());
-				if (boost::starts_with(str, token)) {
-					selected = true;
-				}
+			else if (idMatches(ent->id(), token)) { // по идентификатору
+				selected = true;
 			}
 
 			if (selected) {
@@ -736,6 +1419,738 @@ void System::onCommand_to(const std::string& command)
 	}
 }
 
+bool System::isValid(EntityHandle handle) const
+{
+	return entity(handle) != nullptr;
+}
+
+Entity* System::entity(EntityHandle handle) const
+{
+	SlotHandle slot;
+	slot.index = handle.index;
+	slot.generation = handle.generation;
+	Entity* const* ent = _p->handles.get(slot);
+
+	return ent ? *ent : nullptr;
+}
+
+std::shared_ptr<Entity> System::lock(EntityHandle handle) const
+{
+	Entity* ent = entity(handle);
+	if (!ent || ent == this)
+		return nullptr;
+
+	return ent->shared_from_this();
+}
+
+void System::Private::registerHandle(Entity* ent)
+{
+	SlotHandle slot = handles.insert(ent);
+	ent->_p->handle.index = slot.index;
+	ent->_p->handle.generation = slot.generation;
+
+	// повторно используемая сущность возвращает в индекс и свою грань Spatial
+	if (spatialIndex || spatialGrid)
+		indexSpatial(spatialOf(ent));
+}
+
+void System::Private::releaseHandle(Entity* ent)
+{
+	if (ent->_p->handle.isNull())
+		return;
+
+	SlotHandle slot;
+	slot.index = ent->_p->handle.index;
+	slot.generation = ent->_p->handle.generation;
+	handles.remove(slot);
+	ent->_p->handle = EntityHandle();
+}
+
+static SpatialBox spatialBox(const point3d& pos, double size)
+{
+	double r = std::max(size, 0.0);
+	return SpatialBox(
+		point3d(bg::get<0>(pos) - r, bg::get<1>(pos) - r, bg::get<2>(pos) - r),
+		point3d(bg::get<0>(pos) + r, bg::get<1>(pos) + r, bg::get<2>(pos) + r));
+}
+
+void System::Private::indexSpatial(Spatial* sp)
+{
+	if (!sp)
+		return;
+
+	if (spatialIndex && !sp->_p->indexed) {
+		sp->_p->indexedBox = spatialBox(sp->position(), sp->size());
+		sp->_p->indexedHandle = sp->handle();
+		sp->_p->indexed = true;
+
+		unique_lock<shared_timed_mutex> lock(spatialMutex);
+		spatialTree.insert(SpatialValue(sp->_p->indexedBox, sp->_p->indexedHandle));
+	}
+
+	if (spatialGrid && sp->_p->gridSlot < 0) {
+		unique_lock<shared_timed_mutex> lock(gridMutex);
+		sp->_p->gridSlot = static_cast<int64_t>(grid.objects.size());
+		grid.objects.push_back(sp);
+		grid.dirty = true;
+	}
+}
+
+void System::Private::unindexSpatial(Spatial* sp)
+{
+	if (!sp)
+		return;
+
+	if (sp->_p->indexed) {
+		sp->_p->indexed = false;
+
+		unique_lock<shared_timed_mutex> lock(spatialMutex);
+		spatialTree.remove(SpatialValue(sp->_p->indexedBox, sp->_p->indexedHandle));
+	}
+
+	if (sp->_p->gridSlot >= 0) {
+		unique_lock<shared_timed_mutex> lock(gridMutex);
+		// на освободившееся место переносим последний объект
+		Spatial* last = grid.objects.back();
+		grid.objects[sp->_p->gridSlot] = last;
+		last->_p->gridSlot = sp->_p->gridSlot;
+		grid.objects.pop_back();
+		sp->_p->gridSlot = -1;
+		grid.dirty = true;
+	}
+}
+
+void System::Private::updateSpatial(Spatial* sp)
+{
+	SpatialBox box = spatialBox(sp->position(), sp->size());
+
+	unique_lock<shared_timed_mutex> lock(spatialMutex);
+	spatialTree.remove(SpatialValue(sp->_p->indexedBox, sp->_p->indexedHandle));
+	sp->_p->indexedBox = box;
+	spatialTree.insert(SpatialValue(box, sp->_p->indexedHandle));
+}
+
+/// @brief Собрать все пространственные объекты системы.
+///
+/// Объекты сущностей, ожидающих повторного использования, не учитываются.
+static vector<Spatial*> liveSpatials(SlotMap<Entity*>& handles)
+{
+	vector<Spatial*> result;
+	for (int64_t pos = 0; pos < handles.size(); ++pos) {
+		Spatial* sp = dynamic_cast<Spatial*>(handles.at(pos));
+		if (!sp)
+			continue;
+
+		Entity* ent = sp->owner() ? sp->owner() : sp;
+		if (!ent->handle().isNull())
+			result.push_back(sp);
+	}
+
+	return result;
+}
+
+void System::setSpatialIndex(bool on)
+{
+	if (_p->spatialIndex == on)
+		return;
+
+	vector<SpatialValue> values;
+	for (Spatial* sp : liveSpatials(_p->handles)) {
+		sp->_p->indexed = on;
+		if (on) {
+			sp->_p->indexedBox = spatialBox(sp->position(), sp->size());
+			sp->_p->indexedHandle = sp->handle();
+			values.push_back(SpatialValue(sp->_p->indexedBox, sp->_p->indexedHandle));
+		}
+	}
+
+	unique_lock<shared_timed_mutex> lock(_p->spatialMutex);
+	_p->spatialIndex = on;
+	// при включении дерево строится сразу по всем объектам (упаковкой)
+	SpatialTree tree(values.begin(), values.end());
+	_p->spatialTree.swap(tree);
+}
+
+bool System::spatialIndex() const
+{
+	return _p->spatialIndex;
+}
+
+std::vector<EntityHandle> System::queryRadius(const point3d& center, double radius) const
+{
+	vector<EntityHandle> result;
+	shared_lock<shared_timed_mutex> lock(_p->spatialMutex);
+	_p->spatialTree.query(bgi::intersects(spatialBox(center, radius)) && bgi::satisfies([&](const SpatialValue& v) {
+		// область объекта - шар, вписанный в куб записи
+		double r = (bg::get<bg::max_corner, 0>(v.first) - bg::get<bg::min_corner, 0>(v.first)) / 2;
+		point3d pos;
+		bg::centroid(v.first, pos);
+		return bg::distance(center, pos) <= radius + r;
+	}), boost::make_function_output_iterator([&](const SpatialValue& v) {
+		result.push_back(v.second);
+	}));
+
+	return result;
+}
+
+std::vector<EntityHandle> System::queryBox(const point3d& min, const point3d& max) const
+{
+	vector<EntityHandle> result;
+	shared_lock<shared_timed_mutex> lock(_p->spatialMutex);
+	_p->spatialTree.query(bgi::intersects(SpatialBox(min, max)), boost::make_function_output_iterator([&](const SpatialValue& v) {
+		result.push_back(v.second);
+	}));
+
+	return result;
+}
+
+std::vector<EntityHandle> System::nearest(const point3d& point, size_t k) const
+{
+	vector<EntityHandle> result;
+	if (k == 0)
+		return result;
+
+	shared_lock<shared_timed_mutex> lock(_p->spatialMutex);
+	_p->spatialTree.query(bgi::nearest(point, static_cast<unsigned>(k)), boost::make_function_output_iterator([&](const SpatialValue& v) {
+		result.push_back(v.second);
+	}));
+
+	return result;
+}
+
+/// @brief Ближайший предок объекта, имеющий положение в пространстве.
+static Spatial* spatialParent(Spatial* sp)
+{
+	Entity* ent = sp->owner() ? sp->owner() : sp;
+	for (Entity* parent = ent->parent(); parent; parent = parent->parent()) {
+		Spatial* result = spatialOf(parent);
+		if (result)
+			return result;
+	}
+
+	return nullptr;
+}
+
+/// @brief Матрица поворота по углам Эйлера: R = Rz * Ry * Rx.
+static void eulerToMatrix(double ax, double ay, double az, double m[3][3])
+{
+	double sa = std::sin(ax), ca = std::cos(ax);
+	double sb = std::sin(ay), cb = std::cos(ay);
+	double sc = std::sin(az), cc = std::cos(az);
+
+	m[0][0] = cb * cc; m[0][1] = cc * sb * sa - sc * ca; m[0][2] = cc * sb * ca + sc * sa;
+	m[1][0] = cb * sc; m[1][1] = sc * sb * sa + cc * ca; m[1][2] = sc * sb * ca - cc * sa;
+	m[2][0] = -sb;     m[2][1] = cb * sa;                m[2][2] = cb * ca;
+}
+
+/// @brief Углы Эйлера по матрице поворота (обратное к eulerToMatrix).
+static void matrixToEuler(const double m[3][3], double& ax, double& ay, double& az)
+{
+	ay = std::asin(std::max(-1.0, std::min(1.0, -m[2][0])));
+	if (std::abs(m[2][0]) < 1.0 - 1e-12) {
+		ax = std::atan2(m[2][1], m[2][2]);
+		az = std::atan2(m[1][0], m[0][0]);
+	}
+	else {
+		// при повороте вокруг Y на +-90 градусов различимы только сумма или разность углов
+		ax = std::atan2(-m[1][2], m[1][1]);
+		az = 0.0;
+	}
+}
+
+void System::Private::markWorldDirty(Spatial* sp)
+{
+	// объект попадает в список только один раз до пересчёта
+	if (!sp || sp->_p->worldDirty.exchange(true))
+		return;
+
+	// у каждого рабочего потока свой список, поэтому блокировка не разделяется
+	// между потоками пула; потоки вне пула пользуются списком 0
+	size_t slot = Scheduler::currentSlot();
+	if (slot >= dirtyLists.size())
+		slot = 0;
+	DirtyList& list = *dirtyLists[slot];
+	lock_guard<std::mutex> lock(list.mutex);
+	sp->_p->dirtyList = slot;
+	sp->_p->dirtySlot = list.objects.size();
+	list.objects.push_back(sp);
+}
+
+void System::Private::unmarkWorldDirty(Spatial* sp)
+{
+	if (!sp->_p->worldDirty)
+		return;
+
+	DirtyList& list = *dirtyLists[sp->_p->dirtyList];
+	lock_guard<std::mutex> lock(list.mutex);
+	Spatial* last = list.objects.back();
+	list.objects[sp->_p->dirtySlot] = last;
+	last->_p->dirtySlot = sp->_p->dirtySlot;
+	list.objects.pop_back();
+	sp->_p->worldDirty = false;
+}
+
+WorldFrame System::Private::worldFrame(Spatial* sp) const
+{
+	const SpatialStore& s = spatials;
+	size_t i = sp->_p->row;
+	WorldFrame frame;
+	frame.position[0] = s.worldX[i];
+	frame.position[1] = s.worldY[i];
+	frame.position[2] = s.worldZ[i];
+	frame.rotated = s.worldOrientX[i] != 0.0 || s.worldOrientY[i] != 0.0 || s.worldOrientZ[i] != 0.0;
+	if (frame.rotated)
+		eulerToMatrix(s.worldOrientX[i], s.worldOrientY[i], s.worldOrientZ[i], frame.rotation);
+
+	return frame;
+}
+
+void System::Private::updateWorldSubtree(Spatial* sp, const WorldFrame& parent)
+{
+	SpatialStore& s = spatials;
+	size_t i = sp->_p->row;
+	double local[3] = { s.x[i], s.y[i], s.z[i] };
+
+	WorldFrame frame;
+	for (int r = 0; r < 3; ++r) {
+		frame.position[r] = parent.position[r];
+		for (int c = 0; c < 3; ++c)
+			frame.position[r] += parent.rotation[r][c] * local[c];
+	}
+
+	bool localRotated = s.orientX[i] != 0.0 || s.orientY[i] != 0.0 || s.orientZ[i] != 0.0;
+	if (!parent.rotated) {
+		// без поворота родителя углы складывать не нужно
+		frame.rotated = localRotated;
+		s.worldOrientX[i] = s.orientX[i];
+		s.worldOrientY[i] = s.orientY[i];
+		s.worldOrientZ[i] = s.orientZ[i];
+		if (localRotated)
+			eulerToMatrix(s.orientX[i], s.orientY[i], s.orientZ[i], frame.rotation);
+	}
+	else {
+		frame.rotated = true;
+		if (localRotated) {
+			double m[3][3];
+			eulerToMatrix(s.orientX[i], s.orientY[i], s.orientZ[i], m);
+			for (int r = 0; r < 3; ++r) {
+				for (int c = 0; c < 3; ++c) {
+					frame.rotation[r][c] = 0.0;
+					for (int k = 0; k < 3; ++k)
+						frame.rotation[r][c] += parent.rotation[r][k] * m[k][c];
+				}
+			}
+		}
+		else {
+			std::copy(&parent.rotation[0][0], &parent.rotation[0][0] + 9, &frame.rotation[0][0]);
+		}
+		matrixToEuler(frame.rotation, s.worldOrientX[i], s.worldOrientY[i], s.worldOrientZ[i]);
+	}
+
+	s.worldX[i] = frame.position[0];
+	s.worldY[i] = frame.position[1];
+	s.worldZ[i] = frame.position[2];
+
+	updateWorldChildren(sp->owner() ? sp->owner() : sp, frame);
+}
+
+void System::Private::updateWorldChildren(Entity* ent, const WorldFrame& parent)
+{
+	for (Entity& child : ent->children()) {
+		Spatial* sp = spatialOf(&child);
+		// сущности без положения в пространстве не меняют систему координат потомков
+		if (sp)
+			updateWorldSubtree(sp, parent);
+		else
+			updateWorldChildren(&child, parent);
+	}
+}
+
+void System::Private::updateWorldTransforms()
+{
+	// списки потоков сливаются в один
+	vector<Spatial*> dirty;
+	for (auto& list : dirtyLists) {
+		lock_guard<std::mutex> lock(list->mutex);
+		dirty.insert(dirty.end(), list->objects.begin(), list->objects.end());
+		list->objects.clear();
+	}
+	if (dirty.empty())
+		return;
+
+	// поддерево пересчитывается от самого верхнего изменённого объекта
+	vector<Spatial*> roots;
+	for (Spatial* sp : dirty) {
+		bool covered = false;
+		for (Spatial* parent = spatialParent(sp); parent && !covered; parent = spatialParent(parent))
+			covered = parent->_p->worldDirty;
+		if (!covered)
+			roots.push_back(sp);
+	}
+
+	// флаги сбрасываются до пересчёта: перемещение во время него снова внесёт объект в список
+	for (Spatial* sp : dirty)
+		sp->_p->worldDirty = false;
+
+	// поддеревья разных корней не пересекаются, поэтому их можно считать параллельно
+	scheduler.parallelFor(roots.size(), [&](size_t k) {
+		Spatial* parent = spatialParent(roots[k]);
+		updateWorldSubtree(roots[k], parent ? worldFrame(parent) : WorldFrame());
+	});
+}
+
+void System::updateWorldTransforms()
+{
+	_p->updateWorldTransforms();
+}
+
+void System::invalidateWorldTransforms()
+{
+	for (Spatial* sp : _p->spatials.objects)
+		_p->markWorldDirty(sp);
+}
+
+/// @brief Номер ячейки по координате.
+///
+/// Номера ограничены с запасом до границ int64, чтобы смещения к соседним
+/// ячейкам не переполнялись; NaN попадает в нулевую ячейку.
+static int64_t cellCoord(double v, double cell)
+{
+	const double limit = 4.0e18;
+	double c = std::floor(v / cell);
+	if (std::isnan(c))
+		return 0;
+	return static_cast<int64_t>(std::min(std::max(c, -limit), limit));
+}
+
+void System::Private::rebuildGrid()
+{
+	unique_lock<shared_timed_mutex> lock(gridMutex);
+
+	grid.snapshot = grid.objects;
+	size_t n = grid.snapshot.size();
+	grid.x.resize(n);
+	grid.y.resize(n);
+	grid.z.resize(n);
+	grid.size.resize(n);
+	grid.entries.resize(n);
+	grid.dirty = false;
+
+	// снимок положений и наибольший размер - по частям в пуле потоков
+	size_t chunks = std::min<size_t>(n, static_cast<size_t>(scheduler.threadCount()) * 4);
+	vector<double> chunkMax(chunks, 0.0);
+	scheduler.parallelFor(chunks, [&](size_t c) {
+		double m = 0.0;
+		for (size_t i = n * c / chunks; i < n * (c + 1) / chunks; ++i) {
+			size_t row = grid.snapshot[i]->_p->row;
+			grid.x[i] = spatials.x[row];
+			grid.y[i] = spatials.y[row];
+			grid.z[i] = spatials.z[row];
+			grid.size[i] = std::max(spatials.size[row], 0.0);
+			m = std::max(m, grid.size[i]);
+		}
+		chunkMax[c] = m;
+	});
+
+	grid.maxSize = 0.0;
+	for (double m : chunkMax)
+		grid.maxSize = std::max(grid.maxSize, m);
+
+	bucketGrid();
+}
+
+void System::Private::bucketGrid()
+{
+	// ячейка не меньше диаметра объекта и радиуса поиска, поэтому соседи
+	// всегда находятся не дальше двух ячеек
+	grid.cellSize = std::max(2 * grid.maxSize, grid.radius);
+	if (!(grid.cellSize > 0.0))
+		grid.cellSize = 1.0;
+
+	size_t n = grid.snapshot.size();
+	size_t chunks = std::min<size_t>(n, static_cast<size_t>(scheduler.threadCount()) * 4);
+	double cell = grid.cellSize;
+	scheduler.parallelFor(chunks, [&](size_t c) {
+		for (size_t i = n * c / chunks; i < n * (c + 1) / chunks; ++i) {
+			GridEntry& e = grid.entries[i];
+			e.cell.x = cellCoord(grid.x[i], cell);
+			e.cell.y = cellCoord(grid.y[i], cell);
+			e.cell.z = cellCoord(grid.z[i], cell);
+			e.index = static_cast<uint32_t>(i);
+		}
+	});
+
+	std::sort(grid.entries.begin(), grid.entries.end(), [](const GridEntry& a, const GridEntry& b) {
+		return a.cell < b.cell || (a.cell == b.cell && a.index < b.index);
+	});
+
+	grid.cells.clear();
+	grid.cells.reserve(n);
+	for (size_t begin = 0; begin < n; ) {
+		size_t end = begin + 1;
+		while (end < n && grid.entries[end].cell == grid.entries[begin].cell)
+			++end;
+		grid.cells.insert(grid.entries[begin].cell, GridCell{ static_cast<uint32_t>(begin), static_cast<uint32_t>(end) });
+		begin = end;
+	}
+}
+
+void System::Private::widenGrid(double radius)
+{
+	unique_lock<shared_timed_mutex> lock(gridMutex);
+	// другой поток мог уже укрупнить ячейки
+	if (radius <= grid.cellSize)
+		return;
+
+	grid.radius = radius;
+	bucketGrid();
+}
+
+SpatialView System::spatialView()
+{
+	SpatialStore& s = _p->spatials;
+	SpatialView view;
+	view.size = s.objects.size();
+	view.objects = s.objects.data();
+	view.x = s.x.data();
+	view.y = s.y.data();
+	view.z = s.z.data();
+	view.orientX = s.orientX.data();
+	view.orientY = s.orientY.data();
+	view.orientZ = s.orientZ.data();
+	view.sizes = s.size.data();
+	view.worldX = s.worldX.data();
+	view.worldY = s.worldY.data();
+	view.worldZ = s.worldZ.data();
+	return view;
+}
+
+void System::setSpatialGrid(bool on)
+{
+	if (_p->spatialGrid == on)
+		return;
+
+	{
+		unique_lock<shared_timed_mutex> lock(_p->gridMutex);
+		for (Spatial* sp : _p->grid.objects)
+			sp->_p->gridSlot = -1;
+		_p->grid = SpatialGrid();
+		_p->spatialGrid = on;
+		if (on) {
+			_p->grid.objects = liveSpatials(_p->handles);
+			for (size_t i = 0; i < _p->grid.objects.size(); ++i)
+				_p->grid.objects[i]->_p->gridSlot = static_cast<int64_t>(i);
+		}
+	}
+
+	if (on)
+		_p->rebuildGrid();
+}
+
+bool System::spatialGrid() const
+{
+	return _p->spatialGrid;
+}
+
+void System::updateSpatialGrid()
+{
+	if (_p->spatialGrid)
+		_p->rebuildGrid();
+}
+
+void System::forEachNeighborPair(double radius, const std::function<void(Spatial&, Spatial&)>& func)
+{
+	if (!_p->spatialGrid || !func)
+		return;
+
+	if (!(radius > 0.0))
+		radius = 0.0;
+
+	bool stale = false;
+	bool narrow = false;
+	{
+		shared_lock<shared_timed_mutex> lock(_p->gridMutex);
+		// после появления и исчезновения объектов снимок недействителен; во время
+		// шага он перестраивается только на границе шага (удаления туда и откладываются)
+		stale = _p->grid.dirty && !_p->stepping;
+		narrow = radius > _p->grid.cellSize;
+	}
+	if (stale)
+		_p->rebuildGrid();
+	if (narrow)
+		_p->widenGrid(radius);
+
+	shared_lock<shared_timed_mutex> lock(_p->gridMutex);
+	SpatialGrid& grid = _p->grid;
+	// через сколько ячеек могут находиться соседи (не более двух)
+	int64_t reach = static_cast<int64_t>(std::ceil((radius + 2 * grid.maxSize) / grid.cellSize));
+	reach = std::min<int64_t>(reach, 2);
+
+	auto test = [&](uint32_t i, uint32_t j) {
+		double dx = grid.x[i] - grid.x[j];
+		double dy = grid.y[i] - grid.y[j];
+		double dz = grid.z[i] - grid.z[j];
+		double limit = radius + grid.size[i] + grid.size[j];
+		if (dx * dx + dy * dy + dz * dz <= limit * limit)
+			func(*grid.snapshot[i], *grid.snapshot[j]);
+	};
+
+	size_t n = grid.entries.size();
+	for (size_t begin = 0; begin < n; ) {
+		const CellKey& home = grid.entries[begin].cell;
+		size_t end = begin + 1;
+		while (end < n && grid.entries[end].cell == home)
+			++end;
+
+		// пары внутри ячейки
+		for (size_t a = begin; a < end; ++a)
+			for (size_t b = a + 1; b < end; ++b)
+				test(grid.entries[a].index, grid.entries[b].index);
+
+		// пары с соседними ячейками - только в "положительной" половине окрестности,
+		// чтобы каждая пара ячеек рассматривалась один раз
+		for (int64_t dx = -reach; dx <= reach; ++dx) {
+			for (int64_t dy = -reach; dy <= reach; ++dy) {
+				for (int64_t dz = -reach; dz <= reach; ++dz) {
+					if (dx < 0 || (dx == 0 && (dy < 0 || (dy == 0 && dz <= 0))))
+						continue;
+
+					CellKey key;
+					key.x = home.x + dx;
+					key.y = home.y + dy;
+					key.z = home.z + dz;
+					const GridCell* cell = grid.cells.find(key);
+					if (!cell)
+						continue;
+
+					for (size_t a = begin; a < end; ++a)
+						for (uint32_t b = cell->begin; b < cell->end; ++b)
+							test(grid.entries[a].index, grid.entries[b].index);
+				}
+			}
+		}
+
+		begin = end;
+	}
+}
+
+void System::setRecyclePoolSize(tid typeId, size_t maxSize)
+{
+	if (typeId == InvalidTypeId)
+		return;
+
+	if (typeId >= _p->recyclePools.size()) {
+		if (maxSize == 0)
+			return;
+		_p->recyclePools.resize(typeId + 1);
+	}
+
+	RecyclePool& pool = _p->recyclePools[typeId];
+	pool.maxSize = maxSize;
+	if (pool.entities.size() > maxSize)
+		pool.entities.resize(maxSize);
+
+	_p->recycling = false;
+	for (const RecyclePool& p : _p->recyclePools) {
+		if (p.maxSize > 0) {
+			_p->recycling = true;
+			break;
+		}
+	}
+}
+
+size_t System::recyclePoolSize(tid typeId) const
+{
+	if (typeId >= _p->recyclePools.size())
+		return 0;
+
+	return _p->recyclePools[typeId].maxSize;
+}
+
+size_t System::recycledCount(tid typeId) const
+{
+	if (typeId >= _p->recyclePools.size())
+		return 0;
+
+	return _p->recyclePools[typeId].entities.size();
+}
+
+void System::setIdMode(IdMode mode)
+{
+	_p->idMode = mode;
+}
+
+IdMode System::idMode() const
+{
+	return _p->idMode;
+}
+
+uid System::newId()
+{
+	uid id;
+	if (_p->idMode == IdMode::Compact) {
+		// старшие байты - префикс сеанса, младшие - номер (big-endian, как в записи UUID)
+		uint64_t number = ++_p->idCounter;
+		for (int i = 0; i < 8; ++i) {
+			id.data[i] = static_cast<uint8_t>(_p->sessionPrefix >> (56 - 8 * i));
+			id.data[8 + i] = static_cast<uint8_t>(number >> (56 - 8 * i));
+		}
+		return id;
+	}
+
+	// генератор создаётся один раз на поток: при создании он обращается к
+	// источнику энтропии ОС, а дальше работает как обычный ГПСЧ
+	static thread_local boost::uuids::random_generator_mt19937 gen;
+	return gen();
+}
+
+// Номер компактного идентификатора этого сеанса; 0 - идентификатор не компактный.
+static uint64_t compactNumber(const uid& id, uint64_t sessionPrefix)
+{
+	uint64_t prefix = 0;
+	uint64_t number = 0;
+	for (int i = 0; i < 8; ++i) {
+		prefix = (prefix << 8) | id.data[i];
+		number = (number << 8) | id.data[8 + i];
+	}
+
+	return prefix == sessionPrefix ? number : 0;
+}
+
+std::string System::idToString(const uid& id) const
+{
+	uint64_t number = compactNumber(id, _p->sessionPrefix);
+	if (number != 0)
+		return std::to_string(number);
+
+	return boost::uuids::to_string(id);
+}
+
+bool System::idMatches(const uid& id, const std::string& token) const
+{
+	if (token.empty())
+		return false;
+
+	// номер сравнивается целиком: по началу номера нельзя однозначно выбрать сущность;
+	// начало полной записи компактного идентификатора могло бы совпасть с чужим номером
+	uint64_t number = compactNumber(id, _p->sessionPrefix);
+	if (number != 0)
+		return std::to_string(number) == token || boost::uuids::to_string(id) == token;
+
+	return boost::starts_with(boost::uuids::to_string(id), token);
+}
+
+bool System::postCommand(const std::string& command)
+{
+	if (!_p->commands.push(command)) {
+		cout << "command queue is full, command dropped: " << command << endl;
+		return false;
+	}
+
+	_p->wake();
+	return true;
+}
+
 void System::onCommand(const std::string& command)
 {
 	//cout << "-> New command received: " << command << endl;
@@ -756,6 +2171,7 @@ void System::onCommand(const std::string& command)
 	// exit application
 	if (cmd == "quit" && lst.size() == 1) {
 		_p->shouldStop = true;
+		_p->wake();
 		return;
 	}
 
@@ -793,7 +2209,9 @@ void System::onCommand(const std::string& command)
 		int i = 0;
 		cout << "Registered entities:" << std::endl;
 		for (auto it = _p->factories.begin(); it != _p->factories.end(); ++it) {
-			auto fact = it->second;
+			auto fact = *it;
+			if (!fact)
+				continue;
 			cout << i + 1 << ": " << fact->typeName() << " {" << fact->typeId() << "} " << endl;
 			++i;
 		}
@@ -809,7 +2227,7 @@ void System::onCommand(const std::string& command)
 			int i = 0;
 			for (auto entPtr = entityIterator(); entPtr.hasMore(); entPtr.next()) {
 				auto ent = entPtr.value();
-				cout << i + 1 << ": " << ent->typeName() << " {" << ent->id() << "} " << ent->name() << endl;
+				cout << i + 1 << ": " << ent->typeName() << " {" << idToString(ent->id()) << "} " << ent->name() << endl;
 				++i;
 			}
 		}
@@ -827,7 +2245,7 @@ void System::onCommand(const std::string& command)
 				auto ent = entPtr.value();
 				auto exe = ent->as<Basis::Executable>();
 				if (exe) {
-					cout << i + 1 << ": " << exe->typeName() << " {" << exe->id() << "} " << exe->name() << endl;
+					cout << i + 1 << ": " << exe->typeName() << " {" << idToString(exe->id()) << "} " << exe->name() << endl;
 					++i;
 				}
 			}
@@ -854,8 +2272,28 @@ void System::onCommand(const std::string& command)
 			if (sublst.size() > 1)
 				token_for_name = sublst[1];
 
+			// форма type*N создаёт сразу N сущностей
+			int64_t count = 1;
+			size_t star = token_for_id.find('*');
+			if (star != string::npos) {
+				try {
+					count = boost::lexical_cast<int64_t>(token_for_id.substr(star + 1));
+				}
+				catch (const boost::bad_lexical_cast&) {
+					cout << "bad value: " << token_for_id.substr(star + 1) << endl;
+					continue;
+				}
+				if (count < 1) {
+					cout << "count must be positive: " << token_for_id.substr(star + 1) << endl;
+					continue;
+				}
+				token_for_id = token_for_id.substr(0, star);
+			}
+
 			for (auto it = _p->factories.begin(); it != _p->factories.end(); ++it) {
-				auto fact = it->second;
+				auto fact = *it;
+				if (!fact)
+					continue;
 				bool selected = false;
 
 				string typeName = boost::to_lower_copy(fact->typeName());
@@ -870,12 +2308,20 @@ void System::onCommand(const std::string& command)
 					}
 				}
 
-				if (selected) {
-					auto newEnt = newEntity(fact->typeId());
+				if (selected && count != 1) {
+					auto created = newEntities(fact->typeId(), count);
+					for (auto& newEnt : created) {
+						if (!token_for_name.empty())
+							newEnt->setName(token_for_name);
+					}
+					cout << created.size() << " new entities created: " << fact->typeName() << endl;
+				}
+				else if (selected) {
+					auto newEnt = newEntity(fact->typeId());
 					if (newEnt) {
 						if (!token_for_name.empty())
 							newEnt->setName(token_for_name);
-						cout << "New entity created: " << newEnt->typeName() << " {" << newEnt->id() << "} ";
+						cout << "New entity created: " << newEnt->typeName() << " {" << idToString(newEnt->id()) << "} ";
 						if (!newEnt->name().empty())
 							cout << ": " << newEnt->name();
 						cout << endl;
@@ -903,12 +2349,8 @@ void System::onCommand(const std::string& command)
 				if (ent->name() == token) { // по имени
 					selected = true;
 				}
-				else {
-					// по UUID
-					std::string str = boost::uuids::to_string(ent->id());
-					if (boost::starts_with(str, token)) {
-						selected = true;
-					}
+				else if (idMatches(ent->id(), token)) { // по идентификатору
+					selected = true;
 				}
 
 				if (selected) {
@@ -965,6 +2407,42 @@ void System::onCommand(const std::string& command)
 		return;
 	}
 
+	if (cmd == "setthreads") {
+		int64_t n = -1;
+		if (lst.size() > 1) {
+			try {
+				n = boost::lexical_cast<int64_t>(lst.at(1));
+			}
+			catch (const boost::bad_lexical_cast&) {
+				cout << "bad value: " << lst.at(1) << endl;
+			}
+		}
+
+		if (n > 0) {
+			setThreadCount(static_cast<int>(n));
+			cout << "step threads: " << threadCount() << endl;
+		}
+		else {
+			cout << "please specify number of threads (1 or more)" << endl;
+		}
+
+		return;
+	}
+
+	if (cmd == "stepmode") {
+		if (lst.size() > 1) {
+			if (lst.at(1) == "flat")
+				setHierarchicalStepping(false);
+			else if (lst.at(1) == "tree")
+				setHierarchicalStepping(true);
+			else
+				cout << "unknown step mode: " << lst.at(1) << endl;
+		}
+		cout << "step mode: " << (isHierarchicalStepping() ? "tree" : "flat") << endl;
+
+		return;
+	}
+
 	if (cmd == "setdelay") {
 		if (lst.size() > 1) {
 			int64_t d = 1;
@@ -986,6 +2464,54 @@ void System::onCommand(const std::string& command)
 		else {
 			cout << "not enough params, please specify delay value in milliseconds" << endl;
 		}
+
+		return;
+	}
+
+	if (cmd == "setrate") {
+		double rate = -1;
+		if (lst.size() > 1) {
+			try {
+				rate = boost::lexical_cast<double>(lst.at(1));
+			}
+			catch (const boost::bad_lexical_cast&) {
+				cout << "bad value: " << lst.at(1) << endl;
+			}
+		}
+
+		if (rate >= 0)
+			setTickRate(rate);
+		else
+			cout << "please specify tick rate (steps per second, 0 for unlimited)" << endl;
+
+		return;
+	}
+
+	if (cmd == "run") {
+		int64_t n = -1;
+		if (lst.size() > 1) {
+			try {
+				n = boost::lexical_cast<int64_t>(lst.at(1));
+			}
+			catch (const boost::bad_lexical_cast&) {
+				cout << "bad value: " << lst.at(1) << endl;
+			}
+		}
+
+		if (n > 0) {
+			_p->runRequest = n;
+			_p->wake();
+		}
+		else {
+			cout << "please specify number of steps" << endl;
+		}
+
+		return;
+	}
+
+	if (cmd == "pacing") {
+		printPacingStats();
+		return;
 	}
 
 	cout << "unknown command: " << cmd << endl;
@@ -994,13 +2520,21 @@ void System::onCommand(const std::string& command)
 
 void System::pause()
 {
-	_p->stepsToDo = -1;
-	_p->paused = true;
+	{
+		lock_guard<mutex> lock(_p->pacingMutex);
+		_p->stepsToDo = -1;
+		_p->paused = true;
+	}
+	_p->pacingCv.notify_all();
 }
 
 void System::resume()
 {
-	_p->paused = false;
+	{
+		lock_guard<mutex> lock(_p->pacingMutex);
+		_p->paused = false;
+	}
+	_p->pacingCv.notify_all();
 }
 
 bool System::isPaused() const
@@ -1013,20 +2547,102 @@ void System::doSteps(uint64_t n)
 	if (!isPaused())
 		return;
 
-	// запоминаем, сколько шагов надо сделать перед тем, как снова встать на паузу:
-	_p->stepsToDo = n;
+	// запоминаем, сколько шагов надо сделать перед тем, как снова встать на паузу,
 	// и начинаем работу:
-	resume();
+	{
+		lock_guard<mutex> lock(_p->pacingMutex);
+		_p->stepsToDo = n;
+		_p->paused = false;
+	}
+	_p->pacingCv.notify_all();
+}
+
+void System::setThreadCount(int n)
+{
+	_p->scheduler.setThreadCount(n);
+
+	// буферы только добавляются: в оставшихся может быть ещё не применённое
+	lock_guard<mutex> lock(_p->buffersMutex);
+	while (_p->buffers.size() < static_cast<size_t>(_p->scheduler.threadCount()))
+		_p->buffers.push_back(make_unique<CommandBuffer>());
+	// списки изменённых объектов тоже (их перебирают без блокировки, поэтому
+	// число потоков нельзя менять одновременно с перемещением объектов)
+	while (_p->dirtyLists.size() < _p->buffers.size())
+		_p->dirtyLists.push_back(make_unique<DirtyList>());
+}
+
+int System::threadCount() const
+{
+	return _p->scheduler.threadCount();
+}
+
+void System::setHierarchicalStepping(bool on)
+{
+	if (_p->hierarchical == on)
+		return;
+
+	_p->hierarchical = on;
+	_p->scheduleDirty = true;
+}
+
+bool System::isHierarchicalStepping() const
+{
+	return _p->hierarchical;
 }
 
 void System::setDelay(int d)
 {
-	_p->delayBetweenSteps = d;
+	setTickRate(d > 0 ? 1000.0 / d : 0.0);
 }
 
 int System::delay() const
 {
-	return _p->delayBetweenSteps;
+	lock_guard<mutex> lock(_p->pacingMutex);
+	return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(_p->tickPeriod).count());
+}
+
+void System::setTickRate(double rate)
+{
+	{
+		lock_guard<mutex> lock(_p->pacingMutex);
+		if (rate > 0)
+			_p->tickPeriod = std::chrono::nanoseconds(static_cast<int64_t>(1e9 / rate));
+		else
+			_p->tickPeriod = std::chrono::nanoseconds(0);
+		_p->deadlineValid = false;
+		_p->pacingChanged = true;
+	}
+	_p->pacingCv.notify_all();
+}
+
+double System::tickRate() const
+{
+	lock_guard<mutex> lock(_p->pacingMutex);
+	if (_p->tickPeriod.count() == 0)
+		return 0.0;
+
+	return 1e9 / _p->tickPeriod.count();
+}
+
+int64_t System::overrunCount() const
+{
+	lock_guard<mutex> lock(_p->pacingMutex);
+	return _p->overruns;
+}
+
+void System::printPacingStats() const
+{
+	lock_guard<mutex> lock(_p->pacingMutex);
+	if (_p->tickPeriod.count() > 0)
+		cout << "target rate: " << 1e9 / _p->tickPeriod.count() << " steps/s" << endl;
+	else
+		cout << "target rate: unlimited" << endl;
+	if (_p->tickIntervalAvg > 0)
+		cout << "actual rate: " << 1.0 / _p->tickIntervalAvg << " steps/s" << endl;
+	cout << "overruns: " << _p->overruns;
+	if (_p->overruns > 0)
+		cout << " (worst: " << std::chrono::duration<double, std::milli>(_p->worstOverrun).count() << " ms)";
+	cout << endl;
 }
 
 void System::printWelcome() const
@@ -1042,10 +2658,17 @@ void System::printUsage() const
 	cout << "  addexec        - add 'executor' entity"               << endl;
 	cout << "  listavailable  - show entities that can be created"   << endl;
 	cout << "  listexistent   - show entities that has been created" << endl;
+	cout << "  create         - create entities (type[*N][:name])"  << endl;
 	cout << "  pause          - pause main loop"                     << endl;
 	cout << "  paused?        - check if we are in paused state"     << endl;
 	cout << "  resume         - resume main loop"                    << endl;
 	cout << "  step           - make one step forward while paused"  << endl;
+	cout << "  setthreads     - set number of threads for stepping"  << endl;
+	cout << "  stepmode       - step direct children (flat) or whole tree (tree)" << endl;
+	cout << "  setdelay       - set step period in milliseconds"     << endl;
+	cout << "  setrate        - set target steps per second"         << endl;
+	cout << "  pacing         - show step rate statistics"           << endl;
+	cout << "  run            - make N steps at full speed"          << endl;
 }
 
 int System::randomInt(int from, int to)
@@ -1117,29 +2740,39 @@ std::shared_ptr<Module> System::Private::loadModule(const std::string& path)
 
 shared_ptr<Entity> System::createEntity(tid typeId)
 {
-	auto iter = _p->factories.find(typeId);
-	if (iter == _p->factories.end())
+	if (typeId >= _p->factories.size())
 		return nullptr;
 
-	FactoryInterface* factory = iter->second.get();
+	FactoryInterface* factory = _p->factories[typeId].get();
 	if (!factory)
 		return nullptr;
 
-	shared_ptr<Entity> ent = shared_ptr<Entity>(factory->newEntity(this));
+	shared_ptr<Entity> ent;
+	if (typeId < _p->recyclePools.size() && !_p->recyclePools[typeId].entities.empty()) {
+		ent = std::move(_p->recyclePools[typeId].entities.back());
+		_p->recyclePools[typeId].entities.pop_back();
+		// грани получают новые дескрипторы раньше сущности: с дескриптором
+		// грани Spatial объект возвращается в пространственный индекс
+		ent->_p->facets.forEach([this](const std::shared_ptr<Entity>& fac) {
+			_p->registerHandle(fac.get());
+		});
+	}
+	else {
+		ent = factory->newSharedEntity(this);
+	}
 	ent->_p->system_ptr = this;
-	// генерируем новый uuid:
-	ent->_p->id = boost::uuids::random_generator()();
+	ent->_p->id = newId();
+	_p->registerHandle(ent.get());
 
 	return ent;
 }
 
 std::string System::typeIdToTypeName(tid typeId) const
 {
-	auto iter = _p->factories.find(typeId);
-	if (iter == _p->factories.end())
+	if (typeId >= _p->factories.size())
 		return std::string();
 
-	FactoryInterface* factory = iter->second.get();
+	FactoryInterface* factory = _p->factories[typeId].get();
 	if (!factory)
 		return std::string();
 
@@ -1148,36 +2781,634 @@ std::string System::typeIdToTypeName(tid typeId) const
 
 void System::step()
 {
-	if (_p->stepsToDo > 0) {
-		_p->stepsToDo--;
-	}
-	else if (_p->stepsToDo == 0) {
-		pause();
-	}
+	// команды выполняются между шагами, поэтому не конкурируют с исполняемыми сущностями
+	string command;
+	while (_p->commands.pop(command))
+		onCommand(command);
 
-	if (isPaused()) {
-		std::this_thread::sleep_for(1s);
+	// прогон, запрошенный командой 'run', выполняется здесь, в главном цикле
+	uint64_t n = _p->runRequest.exchange(0);
+	if (n > 0) {
+		printRunStats(run(n));
 		return;
 	}
 
-	int d = delay();
-	if (d > 0)
-		std::this_thread::sleep_for(std::chrono::milliseconds(d));
+	if (!_p->waitForTick())
+		return;
+
+	runTick();
+}
+
+uint64_t System::runTick()
+{
+	// фазы строятся заранее и перестраиваются только при изменениях,
+	// т.к. исполняемые сущности могут включаться и выключаться во время шага
+	if (_p->scheduleDirty)
+		_p->rebuildSchedule(this);
+
+	// мировые координаты пересчитываются до выполнения сущностей
+	_p->updateWorldTransforms();
 
-	for (auto iter = entityIterator(); iter.hasMore(); iter.next()) {
-		auto ent = iter.value();
-		auto exe = ent->as<Executable>();
-		if (exe) {
-			if (exe->isActive()) {
-				exe->step();
+	// сетка отражает положения объектов на начало шага
+	if (_p->spatialGrid)
+		_p->rebuildGrid();
+
+	uint64_t tick = static_cast<uint64_t>(_p->stepsFromStart);
+	uint64_t processed = 0;
+	// пока выполняются фазы, изменения расписания и удаления откладываются,
+	// поэтому указатели в фазах остаются действительными до конца шага
+	_p->stepping.store(true, memory_order_release);
+	for (StepPhase& phase : _p->phases) {
+		// на каждом шаге берём из каждой группы только одну корзину
+		const vector<Executable*>* mainThread = &_p->dueMain;
+		const vector<Executable*>* parallel = &_p->dueParallel;
+		if (phase.rates.size() == 1) {
+			RateGroup& rate = phase.rates.front();
+			mainThread = &rate.mainThread[tick % rate.period];
+			parallel = &rate.parallel[tick % rate.period];
+		}
+		else {
+			_p->dueMain.clear();
+			_p->dueParallel.clear();
+			for (RateGroup& rate : phase.rates) {
+				const vector<Executable*>& m = rate.mainThread[tick % rate.period];
+				const vector<Executable*>& p = rate.parallel[tick % rate.period];
+				_p->dueMain.insert(_p->dueMain.end(), m.begin(), m.end());
+				_p->dueParallel.insert(_p->dueParallel.end(), p.begin(), p.end());
 			}
+
+			// восстанавливаем порядок по приоритетам между группами
+			auto byRank = [](Executable* a, Executable* b) { return a->_p->scheduleRank < b->_p->scheduleRank; };
+			std::sort(_p->dueMain.begin(), _p->dueMain.end(), byRank);
+			std::sort(_p->dueParallel.begin(), _p->dueParallel.end(), byRank);
 		}
+
+		for (Executable* exe : *mainThread)
+			exe->step();
+
+		// parallelFor возвращается, когда все шаги фазы сделаны
+		_p->scheduler.parallelFor(parallel->size(), [parallel](size_t i) {
+			(*parallel)[i]->step();
+		});
+
+		processed += mainThread->size() + parallel->size();
 	}
+	_p->stepping.store(false, memory_order_release);
+
+	applyDeferred();
 
 	_p->stepsFromStart++;
+
+	return processed;
+}
+
+RunStats System::run(uint64_t n)
+{
+	using clock = std::chrono::steady_clock;
+
+	RunStats stats;
+	LatencyHistogram hist;
+	double totalNs = 0.0;
+
+	clock::time_point start = clock::now();
+	for (uint64_t i = 0; i < n && !shouldStop(); ++i) {
+		clock::time_point tickStart = clock::now();
+		stats.processed += runTick();
+		double ns = std::chrono::duration<double, std::nano>(clock::now() - tickStart).count();
+		hist.add(ns);
+		totalNs += ns;
+		stats.ticks++;
+	}
+	stats.seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+	if (stats.ticks > 0) {
+		stats.meanTickMs = totalNs / stats.ticks / 1e6;
+		stats.p99TickMs = hist.percentile(0.99) / 1e6;
+	}
+	if (stats.seconds > 0) {
+		stats.ticksPerSecond = stats.ticks / stats.seconds;
+		stats.processedPerSecond = stats.processed / stats.seconds;
+	}
+
+	// после прогона график темпа начинается заново
+	{
+		lock_guard<mutex> lock(_p->pacingMutex);
+		_p->deadlineValid = false;
+	}
+
+	return stats;
+}
+
+void System::printRunStats(const RunStats& stats) const
+{
+	cout << "steps: " << stats.ticks << " in " << stats.seconds << " s" << endl;
+	cout << "steps/s: " << stats.ticksPerSecond << endl;
+	cout << "step time, mean: " << stats.meanTickMs << " ms, p99: " << stats.p99TickMs << " ms" << endl;
+	cout << "entities processed/s: " << stats.processedPerSecond << endl;
+}
+
+void LatencyHistogram::add(double ns)
+{
+	// корзина i покрывает [100 * 1.05^i, 100 * 1.05^(i+1)) нс
+	size_t i = 0;
+	if (ns > 100.0)
+		i = std::min(BucketCount - 1, static_cast<size_t>(std::log(ns / 100.0) / std::log(1.05)));
+	buckets[i]++;
+	count++;
+}
+
+double LatencyHistogram::percentile(double q) const
+{
+	if (count == 0)
+		return 0.0;
+
+	uint64_t rank = static_cast<uint64_t>(std::ceil(q * count));
+	uint64_t seen = 0;
+	for (size_t i = 0; i < BucketCount; ++i) {
+		seen += buckets[i];
+		if (seen >= rank)
+			return 100.0 * std::pow(1.05, i + 1); // верхняя граница корзины
+	}
+
+	return 100.0 * std::pow(1.05, BucketCount);
 }
 
 bool System::shouldStop() const
 {
 	return _p->shouldStop;
 }
+
+void System::setArchetypeStorage(bool enable)
+{
+	if (enable == _p->archetypeStorage)
+		return;
+
+	std::function<void(Entity*)> visit = [&](Entity* parent) {
+		for (int64_t pos = 0; pos < parent->_p->entities->size(); ++pos) {
+			Entity* ent = parent->_p->entities->at(pos).get();
+			if (enable)
+				attachToArchetype(ent);
+			visit(ent);
+		}
+	};
+
+	if (enable) {
+		_p->archetypeStorage = true;
+		visit(this);
+	}
+	else {
+		for (int64_t pos = 0; pos < entities()->size(); ++pos)
+			detachFromArchetype(entities()->at(pos).get(), true);
+		_p->archetypeStorage = false;
+		_p->archetypeList.clear();
+		_p->archetypes.clear();
+	}
+}
+
+bool System::archetypeStorage() const
+{
+	return _p->archetypeStorage;
+}
+
+std::vector<ArchetypeView> System::archetypes(const FacetMask& required) const
+{
+	vector<ArchetypeView> res;
+	for (Archetype* arch : _p->archetypeList) {
+		if (arch->entities.empty() || !arch->mask.contains(required))
+			continue;
+
+		ArchetypeView view;
+		view.mask = arch->mask;
+		view.size = arch->entities.size();
+		view.entities = arch->entities.data();
+		for (auto& col : arch->columns)
+			view.columns.push_back(col.data());
+		res.push_back(std::move(view));
+	}
+
+	return res;
+}
+
+void System::applyDeferred()
+{
+	// забираем содержимое всех буферов; команды, отложенные во время применения
+	// (например, из init() новых сущностей), применяются в следующем проходе
+	vector<DeferredCommand> pending;
+	{
+		lock_guard<mutex> lock(_p->buffersMutex);
+		for (auto& buffer : _p->buffers) {
+			lock_guard<mutex> bufferLock(buffer->mutex);
+			std::move(buffer->commands.begin(), buffer->commands.end(), std::back_inserter(pending));
+			buffer->commands.clear();
+		}
+	}
+
+	if (pending.empty())
+		return;
+
+	// подряд идущие команды создания применяются пачкой: новые сущности каждого
+	// родителя попадают в его контейнер и индексы одним проходом
+	vector<shared_ptr<Entity>> holders; // адресаты команд пачки
+	vector<pair<shared_ptr<Entity>, DeferredCommand*>> created;
+	auto flushCreated = [&] {
+		unordered_map<Entity*, vector<shared_ptr<Entity>>> byParent;
+		vector<Entity*> parents;
+		for (size_t i = 0; i < created.size(); ++i) {
+			Entity* parent = holders[i] ? holders[i].get() : created[i].second->target;
+			auto& ents = byParent[parent];
+			if (ents.empty())
+				parents.push_back(parent);
+			ents.push_back(created[i].first);
+		}
+		for (Entity* parent : parents)
+			parent->adoptEntities(byParent[parent]);
+		for (auto& item : created) {
+			if (item.second->onCreated)
+				item.second->onCreated(item.first);
+		}
+		holders.clear();
+		created.clear();
+	};
+
+	for (DeferredCommand& cmd : pending) {
+		shared_ptr<Entity> owner = cmd.weak.lock();
+		Entity* target = cmd.target ? cmd.target : owner.get();
+		if (!target)
+			continue; // адресат уже удалён
+
+		if (cmd.kind == DeferredCommand::Create) {
+			auto ent = createEntity(cmd.typeId);
+			if (ent) {
+				if (!cmd.name.empty())
+					ent->setName(cmd.name);
+				holders.push_back(owner);
+				created.push_back(make_pair(ent, &cmd));
+			}
+			continue;
+		}
+
+		// остальные команды могут зависеть от уже созданных сущностей
+		flushCreated();
+
+		switch (cmd.kind) {
+		case DeferredCommand::Create:
+			break;
+		case DeferredCommand::Remove:
+			target->removeEntity(cmd.id);
+			break;
+		case DeferredCommand::Rename:
+			target->setName(cmd.name);
+			break;
+		case DeferredCommand::AddFacet:
+			target->addFacet(cmd.typeId);
+			break;
+		case DeferredCommand::Call:
+			cmd.action();
+			break;
+		}
+	}
+
+	flushCreated();
+}
+
+CommandBuffer* System::Private::threadBuffer()
+{
+	// список буферов меняется только в setThreadCount() вне шага, поэтому
+	// выбор буфера обходится без общей блокировки
+	size_t slot = Scheduler::currentSlot();
+	if (slot >= buffers.size())
+		slot = 0;
+
+	return buffers[slot].get();
+}
+
+bool System::Private::waitForTick()
+{
+	using clock = std::chrono::steady_clock;
+
+	unique_lock<mutex> lock(pacingMutex);
+
+	if (stepsToDo > 0) {
+		stepsToDo--;
+	}
+	else if (stepsToDo == 0) {
+		stepsToDo = -1;
+		paused = true;
+	}
+
+	if (paused) {
+		// resume/step/quit будят цикл сразу; таймаут лишь периодически
+		// возвращает управление главному циклу
+		pacingCv.wait_for(lock, 1s, [this] { return !paused || shouldStop || runRequest > 0 || !commands.empty(); });
+		deadlineValid = false;
+		lastTick = clock::time_point();
+		return false;
+	}
+
+	clock::time_point now = clock::now();
+	if (tickPeriod.count() > 0) {
+		if (!deadlineValid) {
+			nextDeadline = now;
+			deadlineValid = true;
+		}
+
+		if (now < nextDeadline) {
+			pacingChanged = false;
+			pacingCv.wait_until(lock, nextDeadline, [this] { return paused || shouldStop || pacingChanged || runRequest > 0 || !commands.empty(); });
+			if (paused || shouldStop || pacingChanged || runRequest > 0 || !commands.empty())
+				return false;
+			now = clock::now();
+		}
+		else if (now - nextDeadline > tickPeriod) {
+			// шаг опоздал больше чем на период: фиксируем перегрузку и
+			// не пытаемся наверстать пропущенные шаги
+			overruns++;
+			worstOverrun = std::max(worstOverrun, std::chrono::duration_cast<std::chrono::nanoseconds>(now - nextDeadline));
+			nextDeadline = now;
+		}
+
+		// следующий срок отсчитывается от графика, а не от фактического начала шага
+		nextDeadline += tickPeriod;
+	}
+
+	if (lastTick != clock::time_point()) {
+		double interval = std::chrono::duration<double>(now - lastTick).count();
+		tickIntervalAvg = (tickIntervalAvg > 0) ? tickIntervalAvg * 0.9 + interval * 0.1 : interval;
+	}
+	lastTick = now;
+
+	return true;
+}
+
+void System::Private::wake()
+{
+	{
+		lock_guard<mutex> lock(pacingMutex);
+	}
+	pacingCv.notify_all();
+}
+
+bool System::Private::hasActiveExecutables(Entity* root)
+{
+	lock_guard<std::mutex> lock(scheduleMutex);
+	if (root->_p->activeExecutables > 0)
+		return true;
+	// в плоском режиме выполняются только сущности верхнего уровня,
+	// поэтому вложенные в переносимую сущность значения не имеют
+	if (!hierarchical)
+		return false;
+
+	vector<Entity*> stack = { root };
+	while (!stack.empty()) {
+		Entity* ent = stack.back();
+		stack.pop_back();
+		if (ent->_p->activeExecutables > 0)
+			return true;
+
+		const EntitySlots& children = *ent->_p->entities;
+		for (size_t pos = 0; pos < children.size(); ++pos)
+			stack.push_back(children.at(pos).get());
+	}
+	return false;
+}
+
+void System::Private::rebuildSchedule(System* sys)
+{
+	lock_guard<std::mutex> lock(scheduleMutex);
+	scheduleDirty = false;
+	phases.clear();
+
+	vector<Executable*> exes;
+	if (hierarchical) {
+		// исполняемые сущности дерева в порядке прямого обхода; отсоединённые
+		// от дерева сущности при обходе не встречаются
+		unordered_map<Entity*, vector<Executable*>> byEntity;
+		for (Executable* exe : activeExecutables)
+			byEntity[exe->owner() ? exe->owner() : exe].push_back(exe);
+
+		size_t found = 0;
+		vector<Entity*> stack;
+		const EntitySlots& roots = *sys->entities();
+		for (int64_t pos = roots.size() - 1; pos >= 0; --pos)
+			stack.push_back(roots.at(pos).get());
+		while (!stack.empty() && found < activeExecutables.size()) {
+			Entity* ent = stack.back();
+			stack.pop_back();
+
+			auto iter = byEntity.find(ent);
+			if (iter != byEntity.end()) {
+				exes.insert(exes.end(), iter->second.begin(), iter->second.end());
+				found += iter->second.size();
+			}
+
+			// вложенные сущности кладём в обратном порядке, чтобы обходить их в прямом
+			const EntitySlots& children = *ent->_p->entities;
+			for (int64_t pos = children.size() - 1; pos >= 0; --pos)
+				stack.push_back(children.at(pos).get());
+		}
+	}
+	else {
+		// шагаем только активными исполняемыми сущностями, принадлежащими
+		// непосредственно вложенным в систему сущностям
+		for (Executable* exe : activeExecutables) {
+			Entity* ent = exe->owner() ? exe->owner() : exe;
+			if (ent->parent() == sys)
+				exes.push_back(exe);
+		}
+	}
+
+	// более приоритетные сущности раньше попадают в топологический порядок и в списки фаз
+	std::stable_sort(exes.begin(), exes.end(), [](Executable* a, Executable* b) {
+		return a->_p->priority > b->_p->priority;
+	});
+	for (size_t i = 0; i < exes.size(); ++i)
+		exes[i]->_p->scheduleRank = i;
+
+	size_t n = exes.size();
+	vector<vector<size_t>> next(n); // рёбра "выполнить раньше"
+	vector<size_t> inDegree(n, 0);
+
+	bool constrained = false;
+	for (Executable* exe : exes) {
+		if (!exe->_p->before.empty() || !exe->_p->after.empty()) {
+			constrained = true;
+			break;
+		}
+	}
+
+	if (constrained) {
+		unordered_map<tid, vector<size_t>> byType;
+		for (size_t i = 0; i < n; ++i)
+			byType[exes[i]->executableTypeId()].push_back(i);
+
+		for (size_t i = 0; i < n; ++i) {
+			for (tid typeId : exes[i]->_p->before) {
+				auto iter = byType.find(typeId);
+				if (iter == byType.end())
+					continue;
+				for (size_t j : iter->second) {
+					if (j != i) {
+						next[i].push_back(j);
+						inDegree[j]++;
+					}
+				}
+			}
+			for (tid typeId : exes[i]->_p->after) {
+				auto iter = byType.find(typeId);
+				if (iter == byType.end())
+					continue;
+				for (size_t j : iter->second) {
+					if (j != i) {
+						next[j].push_back(i);
+						inDegree[i]++;
+					}
+				}
+			}
+		}
+	}
+
+	// топологический обход (алгоритм Кана)
+	vector<size_t> order;
+	order.reserve(n);
+	for (size_t i = 0; i < n; ++i) {
+		if (inDegree[i] == 0)
+			order.push_back(i);
+	}
+	for (size_t k = 0; k < order.size(); ++k) {
+		for (size_t j : next[order[k]]) {
+			if (--inDegree[j] == 0)
+				order.push_back(j);
+		}
+	}
+	if (order.size() < n) {
+		cout << "cyclic ordering constraints between executables, ignoring them for "
+			<< n - order.size() << " executable(s)" << endl;
+		for (size_t i = 0; i < n; ++i) {
+			if (inDegree[i] > 0)
+				order.push_back(i);
+		}
+	}
+
+	vector<size_t> minPhase(n, 0);
+	for (size_t i : order) {
+		Executable* exe = exes[i];
+		const FacetMask& reads = exe->_p->readSet;
+		const FacetMask& writes = exe->_p->writeSet;
+
+		// первая фаза после всех предшественников, не конфликтующая по данным
+		size_t p = minPhase[i];
+		while (p < phases.size() &&
+			(writes.intersects(phases[p].reads) || writes.intersects(phases[p].writes) || reads.intersects(phases[p].writes)))
+			++p;
+		if (p == phases.size())
+			phases.emplace_back();
+
+		StepPhase& phase = phases[p];
+		uint32_t period = exe->_p->period;
+		auto rate = std::find_if(phase.rates.begin(), phase.rates.end(),
+			[period](const RateGroup& r) { return r.period == period; });
+		if (rate == phase.rates.end()) {
+			phase.rates.emplace_back();
+			rate = phase.rates.end() - 1;
+			rate->period = period;
+			rate->mainThread.resize(period);
+			rate->parallel.resize(period);
+		}
+		if (exe->isMainThreadOnly())
+			rate->mainThread[exe->_p->phase].push_back(exe);
+		else
+			rate->parallel[exe->_p->phase].push_back(exe);
+		phase.reads |= reads;
+		phase.writes |= writes;
+
+		for (size_t j : next[i])
+			minPhase[j] = std::max(minPhase[j], p + 1);
+	}
+}
+
+Archetype* System::Private::archetypeFor(const FacetMask& mask)
+{
+	auto iter = archetypes.find(mask);
+	if (iter != archetypes.end())
+		return iter->second.get();
+
+	auto arch = make_unique<Archetype>();
+	arch->mask = mask;
+	for (tid typeId = 0; typeId < MaxEntityTypes; ++typeId) {
+		if (mask.test(typeId))
+			arch->types.push_back(typeId);
+	}
+	arch->columns.resize(arch->types.size());
+
+	Archetype* ret = arch.get();
+	archetypes[mask] = std::move(arch);
+	archetypeList.push_back(ret);
+
+	return ret;
+}
+
+void System::attachToArchetype(Entity* ent, tid addedType)
+{
+	Archetype* current = ent->_p->archetype;
+	Archetype* target = nullptr;
+
+	// переход по добавленной грани мог уже встречаться
+	if (current && addedType < current->addEdges.size())
+		target = current->addEdges[addedType];
+
+	if (!target) {
+		FacetMask mask = ent->_p->facets.mask;
+		if (ent->_p->typeId != InvalidTypeId)
+			mask.set(ent->_p->typeId);
+		target = _p->archetypeFor(mask);
+
+		if (current && addedType != InvalidTypeId) {
+			if (addedType >= current->addEdges.size())
+				current->addEdges.resize(addedType + 1, nullptr);
+			current->addEdges[addedType] = target;
+		}
+	}
+
+	if (target == current)
+		return;
+	if (current)
+		detachFromArchetype(ent);
+
+	uint32_t row = static_cast<uint32_t>(target->entities.size());
+	target->entities.push_back(ent);
+	for (size_t col = 0; col < target->types.size(); ++col) {
+		tid typeId = target->types[col];
+		// собственный тип сущности имеет приоритет над гранью того же типа, как и в as()
+		Entity* cell = (typeId == ent->_p->typeId) ? ent : ent->_p->facets.find(typeId)->get();
+		target->columns[col].push_back(cell);
+	}
+
+	ent->_p->archetype = target;
+	ent->_p->archetypeRow = row;
+}
+
+void System::detachFromArchetype(Entity* ent, bool recursive)
+{
+	Archetype* arch = ent->_p->archetype;
+	if (arch) {
+		// на место удаляемой строки переносим последнюю
+		uint32_t row = ent->_p->archetypeRow;
+		uint32_t last = static_cast<uint32_t>(arch->entities.size() - 1);
+		if (row != last) {
+			arch->entities[row] = arch->entities[last];
+			for (auto& col : arch->columns)
+				col[row] = col[last];
+			arch->entities[row]->_p->archetypeRow = row;
+		}
+		arch->entities.pop_back();
+		for (auto& col : arch->columns)
+			col.pop_back();
+
+		ent->_p->archetype = nullptr;
+	}
+
+	if (recursive) {
+		for (int64_t pos = 0; pos < ent->_p->entities->size(); ++pos)
+			detachFromArchetype(ent->_p->entities->at(pos).get(), true);
+	}
+}
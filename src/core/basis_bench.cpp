@@ -0,0 +1,111 @@
+#include "basis.h"
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+
+using namespace Basis;
+using namespace std;
+
+// Лучшее из нескольких измерений времени прохода, в наносекундах на сущность.
+template <class Func>
+static double measure(int64_t count, Func func)
+{
+	double best = 0.0;
+	for (int i = 0; i < 5; ++i) {
+		auto start = chrono::steady_clock::now();
+		func();
+		double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / count;
+		best = (i == 0) ? ns : std::min(best, ns);
+	}
+
+	return best;
+}
+
+static void report(const char* what, double oldNs, double newNs)
+{
+	cout << what << ": entityIterator " << oldNs << " ns, children " << newNs << " ns per entity"
+		<< " (x" << (newNs > 0.0 ? oldNs / newNs : 0.0) << ")" << endl;
+}
+
+void Basis::Test::benchmark()
+{
+	System* sys = System::instance();
+
+	// половина дочерних сущностей - пространственные
+	int64_t n = 1000000;
+	auto root = sys->newEntity<Entity>();
+	root->newEntities(TYPEID(Spatial), n / 2);
+	root->newEntities(TYPEID(Entity), n / 2);
+
+	// результат суммирования выводится, чтобы циклы не были выброшены оптимизатором
+	double sum = 0.0;
+
+	double oldAll = measure(n, [&] {
+		for (auto iter = root->entityIterator(); iter.hasMore(); iter.next())
+			sum += static_cast<double>(iter.value()->typeId());
+	});
+	double newAll = measure(n, [&] {
+		for (Entity& ent : root->children())
+			sum += static_cast<double>(ent.typeId());
+	});
+	report("all children", oldAll, newAll);
+
+	double oldSpatial = measure(n, [&] {
+		auto match = [](std::shared_ptr<Entity> ent) { return ent->typeId() == TYPEID(Spatial); };
+		for (auto iter = root->entityIterator(match); iter.hasMore(); iter.next())
+			sum += entityCast<Spatial>(iter.value())->size();
+	});
+	double newSpatial = measure(n, [&] {
+		for (Spatial& sp : root->children<Spatial>())
+			sum += sp.size();
+	});
+	report("Spatial children", oldSpatial, newSpatial);
+
+	double oldSelected = measure(n, [&] {
+		auto match = [](std::shared_ptr<Entity> ent) {
+			auto sp = entityCast<Spatial>(ent);
+			return sp && sp->size() >= 0.0;
+		};
+		for (auto iter = root->entityIterator(match); iter.hasMore(); iter.next())
+			sum += entityCast<Spatial>(iter.value())->size();
+	});
+	double newSelected = measure(n, [&] {
+		for (Spatial& sp : root->children<Spatial>([](Spatial& s) { return s.size() >= 0.0; }))
+			sum += sp.size();
+	});
+	report("Spatial children with selector", oldSelected, newSelected);
+
+	// сдвиг всех пространственных объектов: по одному и через массивы
+	double oneByOne = measure(n / 2, [&] {
+		for (Spatial& sp : root->children<Spatial>()) {
+			point3d pos = sp.position();
+			bg::set<0>(pos, bg::get<0>(pos) + 1.0);
+			sp.setPosition(pos);
+		}
+	});
+	double bulk = measure(n / 2, [&] {
+		SpatialView view = sys->spatialView();
+		for (size_t i = 0; i < view.size; ++i)
+			view.x[i] += 1.0;
+	});
+	cout << "move Spatial: setPosition " << oneByOne << " ns, spatialView " << bulk << " ns per entity"
+		<< " (x" << (bulk > 0.0 ? oneByOne / bulk : 0.0) << ")" << endl;
+
+	// пакетные функции на каждом доступном наборе команд
+	Batch::SimdLevel previous = Batch::simdLevel();
+	const char* levelNames[] = { "scalar", "SSE2", "AVX2" };
+	for (int level = 0; level <= static_cast<int>(Batch::supportedSimdLevel()); ++level) {
+		Batch::setSimdLevel(static_cast<Batch::SimdLevel>(level));
+		PointArrays positions = sys->spatialView().positions();
+		std::vector<double> lengths(positions.size);
+		double translate = measure(n / 2, [&] { Batch::translate(positions, point3d(1.0, 0.5, 0.25)); });
+		double lengthNs = measure(n / 2, [&] { Batch::length(positions, lengths.data()); });
+		sum += lengths.empty() ? 0.0 : lengths.front();
+		cout << "Batch (" << levelNames[level] << "): translate " << translate << " ns, length " << lengthNs << " ns per point" << endl;
+	}
+	Batch::setSimdLevel(previous);
+
+	cout << "(checksum " << sum << ")" << endl;
+
+	sys->removeEntity(root->id());
+}
@@ -1,10 +1,18 @@
 #pragma once
 
 #include "basis.h"
+#include "flat_index.h"
+#include "scheduler.h"
+#include "command_queue.h"
 #include <map>
+#include <unordered_map>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <shared_mutex>
 #include <functional>
 #include <boost/dll.hpp>
+#include <boost/geometry/index/rtree.hpp>
 #include <boost/function.hpp>
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int_distribution.hpp>
@@ -19,30 +27,306 @@ namespace Basis
 		boost::function<void(Basis::System*)> setup_func;
 	};
 
-	struct Entity::Private
+	/// @brief Реестр идентификаторов типов (общий для ядра и всех модулей).
+	struct TypeRegistry
+	{
+		static TypeRegistry& instance();
+
+		std::mutex mutex;                          /// защита от одновременной регистрации
+		std::unordered_map<std::string, tid> ids;  /// идентификаторы по именам типов
+	};
+
+	/// @brief Набор граней сущности.
+	///
+	/// Грани упорядочены по идентификатору типа, поэтому позиция грани равна числу
+	/// битов маски, предшествующих её типу. Первые InlineCapacity граней хранятся
+	/// прямо в объекте, без отдельного выделения памяти.
+	struct FacetSet
+	{
+		static const size_t InlineCapacity = 4;
+
+		/// @brief Получить грань данного типа (nullptr, если её нет).
+		const std::shared_ptr<Entity>* find(tid typeId) const;
+		/// @brief Добавить грань (грани этого типа ещё не должно быть).
+		void insert(tid typeId, const std::shared_ptr<Entity>& facet);
+		/// @brief Перебрать все грани в порядке возрастания типа.
+		template <class Func>
+		void forEach(Func func) const;
+
+		FacetMask mask;                                          /// типы имеющихся граней
+		size_t count = 0;                                        /// число граней
+		std::shared_ptr<Entity> inlineFacets[InlineCapacity];    /// грани, если их не больше InlineCapacity
+		std::vector<std::shared_ptr<Entity>> overflow;           /// все грани, если их больше InlineCapacity
+	};
+
+	template <class Func>
+	void FacetSet::forEach(Func func) const
+	{
+		const std::shared_ptr<Entity>* data = (count > InlineCapacity) ? overflow.data() : inlineFacets;
+		for (size_t i = 0; i < count; ++i)
+			func(data[i]);
+	}
+
+	/// @brief Архетип: сущности с одинаковым набором граней и столбцы их граней.
+	///
+	/// Столбцы хранят указатели: сами грани остаются отдельными объектами в куче
+	/// (ими владеют shared_ptr, и при переходе в другой архетип они не переезжают).
+	struct Archetype
+	{
+		FacetMask mask;                            /// типы граней (и собственный тип сущностей)
+		std::vector<tid> types;                    /// типы столбцов в порядке возрастания
+		std::vector<Entity*> entities;             /// строки архетипа
+		std::vector<std::vector<Entity*>> columns; /// столбцы граней
+		std::vector<Archetype*> addEdges;          /// переход при добавлении грани (индекс - тип)
+	};
+
+	/// @brief Отложенное структурное изменение.
+	struct DeferredCommand
+	{
+		enum Kind { Create, Remove, Rename, AddFacet, Call };
+
+		Kind kind;
+		Entity* target = nullptr;     /// адресат команды, если это система
+		std::weak_ptr<Entity> weak;   /// адресат команды в остальных случаях
+		tid typeId = InvalidTypeId;   /// тип создаваемой сущности или грани
+		uid id;                       /// идентификатор удаляемой сущности
+		std::string name;             /// новое имя
+		std::function<void(std::shared_ptr<Entity>)> onCreated; /// обработчик созданной сущности
+		std::function<void()> action; /// отложенный вызов (для Call)
+	};
+
+	/// @brief Буфер отложенных изменений одного потока.
+	struct CommandBuffer
+	{
+		std::mutex mutex;
+		std::vector<DeferredCommand> commands;
+	};
+
+	/// @brief Объекты одного потока, мировые координаты которых нужно пересчитать.
+	struct DirtyList
+	{
+		std::mutex mutex;              /// защита от потоков вне пула, которые делят список 0
+		std::vector<Spatial*> objects; /// изменённые объекты
+	};
+
+	/// @brief Гистограмма длительностей шага с логарифмическими корзинами.
+	///
+	/// Память не зависит от числа замеров; точность процентилей - около 5%.
+	struct LatencyHistogram
+	{
+		static const size_t BucketCount = 512;
+
+		void add(double ns);
+		/// @brief Получить значение процентиля q (0..1) в наносекундах.
+		double percentile(double q) const;
+
+		uint64_t buckets[BucketCount] = {};
+		uint64_t count = 0;
+	};
+
+	/// @brief Размещение объектов класса в общем для класса пуле блоков.
+	///
+	/// Пул никогда не уничтожается: объекты могут освобождаться и после
+	/// завершения main() (например, сущности, на которые остались ссылки).
+	template <class T>
+	struct Pooled
+	{
+		static void* operator new(size_t size) { return pool().allocate(size); }
+		static void operator delete(void* ptr, size_t size) { pool().deallocate(ptr, size); }
+
+		static SlabPool& pool()
+		{
+			static SlabPool* instance = new SlabPool();
+			return *instance;
+		}
+	};
+
+	/// @brief Пул удалённых сущностей одного типа, ожидающих повторного использования.
+	struct RecyclePool
+	{
+		size_t maxSize = 0;                                 /// наибольшее число хранимых сущностей
+		std::vector<std::shared_ptr<Entity>> entities;      /// сохранённые сущности
+	};
+
+	using SpatialBox = boost::geometry::model::box<point3d>;
+	using SpatialValue = std::pair<SpatialBox, EntityHandle>;
+	using SpatialTree = boost::geometry::index::rtree<SpatialValue, boost::geometry::index::rstar<16>>;
+
+	/// @brief Координаты ячейки равномерной сетки.
+	struct CellKey
+	{
+		int64_t x = 0;
+		int64_t y = 0;
+		int64_t z = 0;
+
+		bool operator==(const CellKey& other) const
+		{
+			return x == other.x && y == other.y && z == other.z;
+		}
+
+		bool operator<(const CellKey& other) const
+		{
+			return x < other.x || (x == other.x && (y < other.y || (y == other.y && z < other.z)));
+		}
+	};
+
+	/// @brief Объект равномерной сетки (в порядке ячеек).
+	struct GridEntry
+	{
+		CellKey cell;   /// ячейка объекта
+		uint32_t index; /// номер объекта в снимке сетки
+	};
+
+	/// @brief Диапазон объектов ячейки в массиве GridEntry.
+	struct GridCell
+	{
+		uint32_t begin;
+		uint32_t end;
+	};
+
+	struct CellHash
+	{
+		size_t operator()(const CellKey& cell) const
+		{
+			uint64_t key = static_cast<uint64_t>(cell.x) * 0x9E3779B97F4A7C15ull;
+			key ^= static_cast<uint64_t>(cell.y) * 0xC2B2AE3D27D4EB4Full;
+			key ^= static_cast<uint64_t>(cell.z) * 0x165667B19E3779F9ull;
+			key ^= key >> 33;
+			key *= 0xFF51AFD7ED558CCDull;
+			key ^= key >> 33;
+			return static_cast<size_t>(key);
+		}
+	};
+
+	/// @brief Равномерная сетка пространственных объектов.
+	struct SpatialGrid
+	{
+		std::vector<Spatial*> objects;  /// объекты, попадающие в сетку
+		bool dirty = true;              /// состав объектов изменился после построения
+		double cellSize = 1.0;          /// размер ячейки
+		double radius = 0.0;            /// наибольший радиус поиска соседей (ячейка не меньше его)
+		double maxSize = 0.0;           /// наибольший размер объекта
+		std::vector<Spatial*> snapshot; /// объекты на момент построения
+		std::vector<double> x;          /// положения и размеры на момент построения
+		std::vector<double> y;
+		std::vector<double> z;
+		std::vector<double> size;
+		std::vector<GridEntry> entries; /// объекты, упорядоченные по ячейкам
+		FlatIndex<CellKey, GridCell, CellHash> cells; /// ячейки по координатам
+	};
+
+	struct FacetMaskHash
+	{
+		size_t operator()(const FacetMask& mask) const { return mask.hash(); }
+	};
+
+	struct Entity::Private : Pooled<Entity::Private>
 	{
 		System* system_ptr = nullptr;                  /// ссылка на систему
-		tid         typeId;                            /// идентификатор типа сущности
+		tid         typeId = InvalidTypeId;            /// идентификатор типа сущности
 		uid         id;                                /// уникальный идентификатор сущности
 		std::string name;                              /// собственное имя сущности
 		Entity* parent = nullptr;                      /// ссылка на родительскую сущность
-		std::map<tid, std::shared_ptr<Entity>> facets; /// грани этой сущности
-		std::shared_ptr<List<Entity>> entities;        /// сущности
-		std::map<uid, std::shared_ptr<ListItem<Entity>>> uuidIndex;    /// индексатор по UUID
-		std::multimap<std::string, std::shared_ptr<Entity>> nameIndex; /// индексатор по имени
+		Entity* owner = nullptr;                       /// сущность, гранью которой является данная
+		FacetSet facets;                               /// грани этой сущности
+		SlotHandle slot;                               /// дескриптор этой сущности в списке родителя
+		std::shared_ptr<EntitySlots> entities;         /// сущности
+		UuidIndex uuidIndex;                           /// индексатор по UUID
+		NameIndex nameIndex;                           /// индексатор по имени
+		EntityHandle handle;                           /// дескриптор в реестре системы
+		Archetype* archetype = nullptr;                /// архетип (в режиме хранения по архетипам)
+		uint32_t archetypeRow = 0;                     /// строка в архетипе
+		int activeExecutables = 0;                     /// число активных исполняемых сущностей (сама сущность и её грани)
 	};
 
-	struct Executable::Private
+	struct Executable::Private : Pooled<Executable::Private>
 	{
 		std::function<void()> stepFunction = nullptr; /// функция, вызываемая внутри step()
 		bool active = false; /// activity flag
+		int64_t activeIndex = -1; /// позиция в реестре активных исполняемых сущностей
+		bool mainThreadOnly = false; /// выполнять только в основном потоке
+		FacetMask readSet;           /// типы граней, которые читает шаг
+		FacetMask writeSet;          /// типы граней, которые изменяет шаг
+		std::vector<tid> before;     /// типы исполняемых сущностей, которые должны выполняться позже
+		std::vector<tid> after;      /// типы исполняемых сущностей, которые должны выполняться раньше
+		uint32_t period = 1;         /// период выполнения (в шагах системы)
+		uint32_t phase = 0;          /// номер шага внутри периода
+		int priority = 0;            /// приоритет
+		size_t scheduleRank = 0;     /// позиция в порядке выполнения (при перестроении фаз)
 	};
 
-	struct Spatial::Private
+	/// @brief Исполняемые сущности фазы с одинаковым периодом, разложенные по корзинам.
+	///
+	/// На шаге tick выполняется только корзина с индексом tick % period.
+	struct RateGroup
 	{
-		point3d position;    /// положение в системе координат родителя
-		point3d orientation; /// ориентация в системе координат родителя (углы Эйлера)
-		double size;         /// размер (радиус занимаемой области)
+		uint32_t period = 1;                                /// период выполнения
+		std::vector<std::vector<Executable*>> mainThread;   /// выполняются в основном потоке
+		std::vector<std::vector<Executable*>> parallel;     /// выполняются в пуле потоков
+	};
+
+	/// @brief Фаза шага: исполняемые сущности, которые можно выполнять одновременно.
+	struct StepPhase
+	{
+		std::vector<RateGroup> rates; /// группы по периодам выполнения
+		FacetMask reads;              /// объединение множеств чтения
+		FacetMask writes;             /// объединение множеств записи
+	};
+
+	/// @brief Пространственные данные объектов Spatial системы (по массиву на каждое поле).
+	///
+	/// Положение и ориентация задаются в системе координат родителя, ориентация -
+	/// углами Эйлера (поворот вокруг X, затем вокруг Y, затем вокруг Z), размер -
+	/// радиусом занимаемой области. Рядом хранятся положение и ориентация в мировой
+	/// системе координат, вычисленные при последнем пересчёте. Строки плотные: при
+	/// удалении объекта на его место переносится последний.
+	struct SpatialStore
+	{
+		/// @brief Добавить строку для объекта, заполненную нулями.
+		size_t add(Spatial* sp);
+		/// @brief Удалить строку.
+		/// @return объект, перенесённый на место удалённого (nullptr, если строка была последней)
+		Spatial* remove(size_t row);
+		/// @brief Скопировать данные строки fromRow хранилища from в строку row.
+		void assignRow(size_t row, const SpatialStore& from, size_t fromRow);
+
+		std::mutex mutex;                /// защита от одновременного добавления и удаления
+		std::vector<Spatial*> objects;   /// объекты
+		std::vector<double> x;           /// положение
+		std::vector<double> y;
+		std::vector<double> z;
+		std::vector<double> orientX;     /// ориентация
+		std::vector<double> orientY;
+		std::vector<double> orientZ;
+		std::vector<double> size;        /// размер
+		std::vector<double> worldX;      /// положение в мировой системе координат
+		std::vector<double> worldY;
+		std::vector<double> worldZ;
+		std::vector<double> worldOrientX;/// ориентация в мировой системе координат
+		std::vector<double> worldOrientY;
+		std::vector<double> worldOrientZ;
+	};
+
+	/// @brief Мировая система координат пространственного объекта.
+	struct WorldFrame
+	{
+		double position[3] = { 0.0, 0.0, 0.0 };  /// начало координат
+		double rotation[3][3] = { { 1.0, 0.0, 0.0 }, { 0.0, 1.0, 0.0 }, { 0.0, 0.0, 1.0 } }; /// поворот
+		bool rotated = false;                    /// поворот отличен от тождественного
+	};
+
+	struct Spatial::Private : Pooled<Spatial::Private>
+	{
+		SpatialStore* store = nullptr;   /// хранилище данных системы
+		std::unique_ptr<SpatialStore> ownStore; /// собственное хранилище объекта вне системы
+		size_t row = 0;                  /// строка в хранилище
+		bool indexed = false;            /// объект находится в пространственном индексе
+		int64_t gridSlot = -1;           /// позиция в списке объектов сетки (-1 - не в сетке)
+		std::atomic<bool> worldDirty = { false }; /// мировые координаты поддерева нужно пересчитать
+		size_t dirtyList = 0;            /// список изменённых объектов, в который внесён объект
+		size_t dirtySlot = 0;            /// позиция в этом списке
+		SpatialBox indexedBox;           /// область, с которой объект внесён в индекс
+		EntityHandle indexedHandle;      /// дескриптор, с которым объект внесён в индекс
 	};
 
 	struct System::Private 
@@ -52,15 +336,109 @@ namespace Basis
 		* @return ссылка на публичный интерфейс загруженного модуля
 		*/
 		std::shared_ptr<Module> loadModule(const std::string& path);
+		/**
+		* @brief Построить фазы шага по реестру активных исполняемых сущностей.
+		*
+		* Ограничения порядка задают ориентированный граф; сущности обходятся в
+		* топологическом порядке и помещаются в первую фазу после всех своих
+		* предшественников, не конфликтующую с ними по чтению/записи. Внутри фазы
+		* сущности раскладываются по корзинам своего периода выполнения.
+		*/
+		void rebuildSchedule(System* sys);
+		/// @brief Есть ли в поддереве root активные исполняемые сущности, влияющие на фазы шага.
+		bool hasActiveExecutables(Entity* root);
+		/**
+		* @brief Дождаться момента начала очередного шага.
+		* @return false, если шаг делать не нужно (пауза или завершение)
+		*/
+		bool waitForTick();
+		/// @brief Разбудить главный цикл после изменения состояния паузы/темпа.
+		void wake();
+		/// @brief Зарегистрировать сущность в реестре дескрипторов.
+		void registerHandle(Entity* ent);
+		/// @brief Исключить сущность из реестра дескрипторов.
+		void releaseHandle(Entity* ent);
+		/// @brief Внести пространственный объект в индекс (если индекс включён).
+		void indexSpatial(Spatial* sp);
+		/// @brief Исключить пространственный объект из индекса.
+		void unindexSpatial(Spatial* sp);
+		/// @brief Обновить запись индекса после изменения положения или размера.
+		void updateSpatial(Spatial* sp);
+		/// @brief Перестроить равномерную сетку по текущим положениям объектов.
+		void rebuildGrid();
+		/// @brief Разложить снимок сетки по ячейкам (gridMutex должен быть захвачен).
+		void bucketGrid();
+		/// @brief Укрупнить ячейки сетки до radius, не меняя снимка положений.
+		void widenGrid(double radius);
+		/// @brief Отметить, что мировые координаты объекта и его поддерева нужно пересчитать.
+		void markWorldDirty(Spatial* sp);
+		/// @brief Убрать объект из списка изменённых (при уничтожении).
+		void unmarkWorldDirty(Spatial* sp);
+		/// @brief Пересчитать мировые координаты всех изменённых поддеревьев.
+		void updateWorldTransforms();
+		/// @brief Пересчитать мировые координаты объекта и его поддерева.
+		void updateWorldSubtree(Spatial* sp, const WorldFrame& parent);
+		/// @brief Пересчитать поддеревья пространственных объектов среди потомков сущности.
+		void updateWorldChildren(Entity* ent, const WorldFrame& parent);
+		/// @brief Получить мировую систему координат объекта по сохранённым значениям.
+		WorldFrame worldFrame(Spatial* sp) const;
+		/// @brief Найти или создать архетип с данным набором типов.
+		Archetype* archetypeFor(const FacetMask& mask);
 
 		std::map<std::string, std::shared_ptr<Module>> modules;     /// загруженные модули
-		std::map<tid, std::shared_ptr<FactoryInterface>> factories; /// фабрики сущностей
+		std::vector<std::shared_ptr<FactoryInterface>> factories;   /// фабрики сущностей (индекс - идентификатор типа)
+		int64_t factoriesCount = 0;                                 /// число зарегистрированных фабрик
 		std::atomic<bool> shouldStop = { false };                   /// флаг "Завершить вычисления"
 		std::atomic<bool> paused = { false };                       /// флаг режима "Пауза"
 		boost::random::mt19937 randGen;                             /// генератор случайных чисел
 		int64_t stepsFromStart = 0;                                 /// число шагов, пройденных от старта
 		int64_t stepsToDo = -1;                                     /// число шагов, которые нужно сделать перед следующей паузой
-		int delayBetweenSteps = 0;                                  /// задержка в миллисекундах между шагами
+		std::atomic<uint64_t> runRequest = { 0 };                   /// число шагов, запрошенных командой 'run'
+		MpscQueue<std::string> commands{ 1024 };                    /// команды, ожидающие выполнения в главном цикле
+		SlotMap<Entity*> handles;                                   /// реестр сущностей для дескрипторов EntityHandle
+		std::vector<RecyclePool> recyclePools;                      /// пулы повторного использования (индекс - идентификатор типа)
+		SpatialStore spatials;                                      /// данные пространственных объектов
+		bool spatialIndex = false;                                  /// пространственный индекс включён
+		SpatialTree spatialTree;                                    /// пространственный индекс
+		mutable std::shared_timed_mutex spatialMutex;               /// защита индекса (запросы могут идти параллельно)
+		bool spatialGrid = false;                                   /// равномерная сетка включена
+		SpatialGrid grid;                                           /// равномерная сетка
+		std::shared_timed_mutex gridMutex;                          /// защита сетки
+		bool recycling = false;                                     /// включён хотя бы один пул
+		IdMode idMode = IdMode::Random;                             /// способ порождения идентификаторов
+		uint64_t sessionPrefix = 0;                                 /// префикс компактных идентификаторов этого сеанса
+		std::atomic<uint64_t> idCounter = { 0 };                    /// счётчик компактных идентификаторов
+		mutable std::mutex pacingMutex;                             /// защита состояния паузы и темпа шагов
+		std::condition_variable pacingCv;                           /// пробуждение главного цикла при паузе/ожидании шага
+		std::chrono::nanoseconds tickPeriod{ 0 };                   /// период шагов (0 - без ограничения)
+		std::chrono::steady_clock::time_point nextDeadline;         /// срок начала следующего шага
+		bool deadlineValid = false;                                 /// график шагов задан
+		bool pacingChanged = false;                                 /// период изменился во время ожидания
+		int64_t overruns = 0;                                       /// число перегрузок
+		std::chrono::nanoseconds worstOverrun{ 0 };                 /// наибольшее опоздание шага
+		std::chrono::steady_clock::time_point lastTick;             /// момент начала предыдущего шага
+		double tickIntervalAvg = 0.0;                               /// сглаженный интервал между шагами (с)
+		bool archetypeStorage = false;                              /// режим хранения граней по архетипам
+		std::unordered_map<FacetMask, std::unique_ptr<Archetype>, FacetMaskHash> archetypes; /// архетипы по наборам типов
+		std::vector<Archetype*> archetypeList;                      /// архетипы в порядке создания
+		std::vector<Executable*> activeExecutables;                 /// реестр активных исполняемых сущностей
+		std::vector<StepPhase> phases;                              /// фазы шага
+		std::atomic<bool> scheduleDirty = { true };                 /// фазы шага нужно перестроить
+		std::atomic<bool> stepping = { false };                     /// идёт выполнение фаз шага
+		std::mutex scheduleMutex;                                   /// защита реестра и настроек расписания исполняемых сущностей
+		bool hierarchical = false;                                  /// шаг по всему дереву сущностей
+		std::vector<Executable*> dueMain;                           /// исполняемые на текущем шаге в основном потоке
+		std::vector<Executable*> dueParallel;                       /// исполняемые на текущем шаге в пуле потоков
+		std::mutex buffersMutex;                                    /// защита списка буферов при его изменении и обходе
+		std::vector<std::unique_ptr<CommandBuffer>> buffers;        /// буферы отложенных изменений (по одному на очередь пула потоков)
+		std::vector<std::unique_ptr<DirtyList>> dirtyLists;         /// изменённые пространственные объекты (по одному списку на очередь пула потоков)
+
+		/// @brief Получить буфер отложенных изменений текущего потока.
+		///
+		/// Рабочий поток пула пишет в буфер своей очереди; все остальные потоки -
+		/// в общий буфер 0. Буферы переиспользуются при смене числа потоков.
+		CommandBuffer* threadBuffer();
+		Scheduler scheduler;                                        /// пул потоков для параллельного шага
 
 		Private() {}
 		~Private() {}
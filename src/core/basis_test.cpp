@@ -2,6 +2,10 @@
 #include "basis_private.h"
 #include <functional>
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <set>
 
 using namespace Basis;
 
@@ -76,7 +80,66 @@ namespace Basis {
 
 			void step()
 			{
+				++steps;
 			}
+
+		public:
+			int steps = 0;
+		};
+
+
+		static std::atomic<int> produced = { 0 };
+
+		class Producer : public Basis::Entity
+		{
+		public:
+			Producer(Basis::System* s) : Entity(s)
+			{
+				auto exe = addFacet<Executable>();
+				exe->setStepFunction([] { produced++; });
+				exe->writes<Enumerable>();
+			}
+		};
+
+		class Consumer : public Basis::Entity
+		{
+		public:
+			Consumer(Basis::System* s) : Entity(s)
+			{
+				auto exe = addFacet<Executable>();
+				exe->setStepFunction([this] { seen = produced; });
+				exe->reads<Enumerable>();
+				exe->runAfter<Producer>();
+			}
+
+		public:
+			int seen = 0;
+		};
+
+		class Transient : public Basis::Entity
+		{
+		public:
+			Transient(Basis::System* s) : Entity(s)
+			{
+				addFacet(TYPEID(Executable));
+			}
+
+			bool init() override
+			{
+				++inits;
+				return true;
+			}
+
+			void reset() override
+			{
+				++resets;
+				value = 0;
+			}
+
+		public:
+			int inits = 0;
+			int resets = 0;
+			int value = 0;
 		};
 
 	} // namespace Test
@@ -200,6 +263,15 @@ bool doGeneralTests()
 		if (items.size() != 1)
 			return false;
 
+		//       
+		sys->removeEntities([](std::shared_ptr<Entity> e) { return e->name() == "middle"; });
+		if (sys->entityCount() != 2)
+			return false;
+		if (!sys->findEntitiesByName("middle").empty())
+			return false;
+		if (sys->findEntitiesByName("third").size() != 1)
+			return false;
+
 		sys->removeEntities();
 		if (sys->entityCount() != 0)
 			return false;
@@ -254,6 +326,1164 @@ bool doGeneralTests()
 			return false;
 	}
 
+	//     
+	{
+		int n = 10;
+		std::vector<uid> ids;
+		for (int i = 0; i < n; ++i)
+			ids.push_back(sys->newEntity(TYPEID(InnerEntity))->id());
+
+		//    
+		for (int i = 0; i < n; i += 2)
+			sys->removeEntity(ids[i]);
+		if (sys->entityCount() != n / 2)
+			return false;
+
+		for (int i = 0; i < n; ++i) {
+			auto ent = sys->findEntityById(ids[i]);
+			bool removed = (i % 2 == 0);
+			if (removed && ent)
+				return false;
+			if (!removed && (!ent || ent->id() != ids[i]))
+				return false;
+		}
+
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+	}
+
+	// :       
+	{
+		auto ent = sys->newEntity(TYPEID(Entity));
+		ent->addFacet<Worker>();
+		ent->addFacet<Spatial>();
+		ent->addFacet<Enumerable>()->num = 42;
+		ent->addFacet<InnerEntity>();
+		ent->addFacet<Executable>();
+		if (ent->facetMask().count() != 5)
+			return false;
+		if (!ent->hasFacet<Spatial>() || !ent->hasFacet<Worker>() || ent->hasFacet<OuterEntity>())
+			return false;
+		if (!ent->as<Spatial>() || !ent->as<Executable>() || !ent->as<InnerEntity>())
+			return false;
+		if (ent->as<Enumerable>()->num != 42)
+			return false;
+		if (ent->as<OuterEntity>())
+			return false;
+		if (ent->as<Entity>() != ent)
+			return false;
+
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+	}
+
+	//    
+	{
+		sys->setArchetypeStorage(true);
+
+		int n = 10;
+		for (int i = 0; i < n; ++i)
+			sys->newEntity(TYPEID(InnerEntity))->as<Enumerable>()->num = i;
+		int m = 5;
+		for (int i = 0; i < m; ++i)
+			sys->newEntity(TYPEID(Worker));
+
+		int count = 0;
+		int sum = 0;
+		sys->forEach<Enumerable, Spatial>([&](Entity* ent, Enumerable* en, Spatial* sp) {
+			if (ent->as<Spatial>().get() == sp)
+				++count;
+			sum += en->num;
+		});
+		if (count != n || sum != n * (n - 1) / 2)
+			return false;
+
+		count = 0;
+		sys->forEach<Executable>([&](Entity*, Executable*) { ++count; });
+		if (count != m)
+			return false;
+
+		//       
+		std::shared_ptr<Entity> worker;
+		for (auto iter = sys->entityIterator(); iter.hasMore(); iter.next()) {
+			if (iter.value()->hasFacet<Executable>()) {
+				worker = iter.value();
+				break;
+			}
+		}
+		worker->addFacet<Spatial>();
+		count = 0;
+		sys->forEach<Spatial>([&](Entity*, Spatial*) { ++count; });
+		if (count != n + 1)
+			return false;
+
+		sys->removeEntity(worker->id());
+		count = 0;
+		sys->forEach<Spatial>([&](Entity*, Spatial*) { ++count; });
+		if (count != n)
+			return false;
+
+		sys->removeEntities();
+		count = 0;
+		sys->forEach<Entity>([&](Entity*, Entity*) { ++count; });
+		if (count != 0)
+			return false;
+
+		sys->setArchetypeStorage(false);
+	}
+
+	//    
+	{
+		int n = 4;
+		std::vector<std::shared_ptr<Worker>> workers;
+		for (int i = 0; i < n; ++i)
+			workers.push_back(sys->newEntity<Worker>());
+
+		workers[0]->as<Executable>()->setActive();
+		workers[1]->as<Executable>()->setActive();
+		workers[2]->as<Executable>()->setActive();
+		sys->step();
+		workers[1]->as<Executable>()->setActive(false);
+		sys->step();
+		if (workers[0]->steps != 2 || workers[1]->steps != 1 || workers[2]->steps != 2 || workers[3]->steps != 0)
+			return false;
+
+		//     
+		sys->removeEntity(workers[2]->id());
+		sys->step();
+		if (workers[0]->steps != 3 || workers[2]->steps != 2)
+			return false;
+
+		workers.clear();
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+	}
+
+	//  
+	{
+		sys->setThreadCount(4);
+
+		int n = 100;
+		std::vector<std::shared_ptr<Worker>> workers;
+		for (int i = 0; i < n; ++i) {
+			workers.push_back(sys->newEntity<Worker>());
+			workers.back()->as<Executable>()->setActive();
+		}
+		workers[0]->as<Executable>()->setMainThreadOnly();
+
+		int numSteps = 10;
+		for (int i = 0; i < numSteps; ++i)
+			sys->step();
+		for (auto& worker : workers) {
+			if (worker->steps != numSteps)
+				return false;
+		}
+
+		sys->setThreadCount(1);
+		workers.clear();
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+	}
+
+	//     
+	{
+		sys->registerEntity<Producer>();
+		sys->registerEntity<Consumer>();
+		sys->setThreadCount(4);
+
+		//    ,     
+		int n = 20;
+		std::vector<std::shared_ptr<Consumer>> consumers;
+		for (int i = 0; i < n; ++i) {
+			consumers.push_back(sys->newEntity<Consumer>());
+			consumers.back()->as<Executable>()->setActive();
+		}
+		sys->newEntity<Producer>()->as<Executable>()->setActive();
+
+		int numSteps = 10;
+		for (int i = 0; i < numSteps; ++i) {
+			sys->step();
+			for (auto& consumer : consumers) {
+				if (consumer->seen != produced)
+					return false;
+			}
+		}
+
+		sys->setThreadCount(1);
+		consumers.clear();
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+		sys->unregisterEntity<Producer>();
+		sys->unregisterEntity<Consumer>();
+	}
+
+	//       
+	{
+		sys->setThreadCount(4);
+
+		int n = 50;
+		for (int i = 0; i < n; ++i) {
+			auto ent = sys->newEntity<Worker>();
+			Entity* worker = ent.get();
+			auto exe = ent->as<Executable>();
+			//     ,    
+			exe->setStepFunction([sys, worker] {
+				sys->deferCreate<InnerEntity>("spawned", [](std::shared_ptr<Entity> spawned) {
+					spawned->deferAddFacet<Executable>();
+				});
+				worker->deferRename("done");
+				sys->deferRemove(worker->id());
+			});
+			exe->setActive();
+		}
+
+		sys->step();
+		if (sys->entityCount() != n)
+			return false;
+		if (sys->findEntitiesByName("spawned").size() != n)
+			return false;
+		if (!sys->findEntitiesByName("done").empty())
+			return false;
+
+		// ,   ,    
+		sys->step();
+		if (sys->entityCount() != n)
+			return false;
+		if (sys->entityCount(check_executable) != n)
+			return false;
+
+		//      ,   
+		sys->removeEntities();
+		sys->setThreadCount(2);
+		sys->setThreadCount(4);
+		for (int i = 0; i < n; ++i) {
+			auto exe = sys->newEntity<Worker>()->as<Executable>();
+			exe->setStepFunction([sys] { sys->deferCreate<InnerEntity>("respawned"); });
+			exe->setActive();
+		}
+		sys->step();
+		if (sys->findEntitiesByName("respawned").size() != n || sys->entityCount() != 2 * n)
+			return false;
+
+		sys->setThreadCount(1);
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+	}
+
+	//     
+	{
+		sys->setTickRate(500);
+		auto start = std::chrono::steady_clock::now();
+		int numSteps = 10;
+		for (int i = 0; i < numSteps; ++i)
+			sys->step();
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		sys->setTickRate(0);
+
+		//    ,  -  2  
+		if (elapsed < std::chrono::milliseconds(2 * (numSteps - 1)))
+			return false;
+		if (sys->delay() != 0 || sys->tickRate() != 0)
+			return false;
+	}
+
+	//      
+	{
+		sys->setTickRate(10); //     
+		int n = 5;
+		std::vector<std::shared_ptr<Worker>> workers;
+		for (int i = 0; i < n; ++i) {
+			workers.push_back(sys->newEntity<Worker>());
+			workers.back()->as<Executable>()->setActive();
+		}
+
+		int numSteps = 100;
+		auto start = std::chrono::steady_clock::now();
+		RunStats stats = sys->run(numSteps);
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		sys->setTickRate(0);
+
+		if (elapsed > std::chrono::seconds(1))
+			return false;
+		if (stats.ticks != numSteps || stats.processed != n * numSteps)
+			return false;
+		if (stats.p99TickMs <= 0.0 || stats.meanTickMs <= 0.0)
+			return false;
+		for (auto& worker : workers) {
+			if (worker->steps != numSteps)
+				return false;
+		}
+
+		workers.clear();
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+	}
+
+	//     
+	{
+		std::vector<int> order;
+		auto outer = sys->newEntity<Worker>();
+		auto inner = outer->newEntity<Worker>();
+		auto innermost = inner->newEntity<Worker>();
+		auto sibling = sys->newEntity<Worker>();
+		//    ,     
+		innermost->as<Executable>()->setStepFunction([&order] { order.push_back(3); });
+		innermost->as<Executable>()->setActive();
+		inner->as<Executable>()->setStepFunction([&order] { order.push_back(2); });
+		inner->as<Executable>()->setActive();
+		outer->as<Executable>()->setStepFunction([&order] { order.push_back(1); });
+		outer->as<Executable>()->setActive();
+		sibling->as<Executable>()->setStepFunction([&order] { order.push_back(4); });
+		sibling->as<Executable>()->setActive();
+
+		//         
+		sys->step();
+		if (order != std::vector<int>({ 1, 4 }))
+			return false;
+
+		order.clear();
+		sys->setHierarchicalStepping(true);
+		sys->step();
+		if (order != std::vector<int>({ 1, 2, 3, 4 }))
+			return false;
+
+		//     
+		order.clear();
+		outer->removeEntity(inner->id());
+		sys->step();
+		if (order != std::vector<int>({ 1, 4 }))
+			return false;
+
+		sys->setHierarchicalStepping(false);
+		inner.reset();
+		innermost.reset();
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+	}
+
+	// ,    
+	{
+		int n = 4;
+		std::vector<std::shared_ptr<Worker>> workers;
+		for (int i = 0; i < n; ++i) {
+			workers.push_back(sys->newEntity<Worker>());
+			workers.back()->as<Executable>()->setActive();
+		}
+		workers[1]->as<Executable>()->setPeriod(10);
+		workers[2]->as<Executable>()->setPeriod(10, 3);
+		workers[3]->as<Executable>()->setPeriod(100, 7);
+
+		//     ,   
+		std::vector<std::vector<int64_t>> ticks(n);
+		for (int i = 0; i < n; ++i) {
+			Worker* worker = workers[i].get();
+			std::vector<int64_t>* seen = &ticks[i];
+			workers[i]->as<Executable>()->setStepFunction([sys, worker, seen] {
+				++worker->steps;
+				seen->push_back(sys->stepsFromStart());
+			});
+		}
+
+		//     ,       
+		int numSteps = 200;
+		int64_t first = sys->stepsFromStart();
+		RunStats stats = sys->run(numSteps);
+		if (workers[0]->steps != numSteps || workers[1]->steps != 20 || workers[2]->steps != 20 || workers[3]->steps != 2)
+			return false;
+		if (stats.processed != static_cast<uint64_t>(numSteps + 20 + 20 + 2))
+			return false;
+		for (size_t k = 0; k < ticks[0].size(); ++k) {
+			if (ticks[0][k] != first + static_cast<int64_t>(k))
+				return false;
+		}
+		for (int64_t t : ticks[1]) {
+			if (t % 10 != 0)
+				return false;
+		}
+		for (int64_t t : ticks[2]) {
+			if (t % 10 != 3)
+				return false;
+		}
+		for (int64_t t : ticks[3]) {
+			if (t % 100 != 7)
+				return false;
+		}
+
+		//       
+		std::vector<int> order;
+		for (int i = 0; i < n; ++i) {
+			auto exe = workers[i]->as<Executable>();
+			exe->setPeriod(1);
+			exe->setMainThreadOnly();
+			exe->setStepFunction([&order, i] { order.push_back(i); });
+		}
+		workers[2]->as<Executable>()->setPriority(10);
+		workers[3]->as<Executable>()->setPriority(-1);
+		sys->step();
+		if (order != std::vector<int>({ 2, 0, 1, 3 }))
+			return false;
+
+		workers.clear();
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+	}
+
+	//  :  ,  
+	{
+		MpscQueue<int> queue(64);
+		int numThreads = 4;
+		int perThread = 10000;
+		std::vector<std::thread> threads;
+		for (int t = 0; t < numThreads; ++t) {
+			threads.emplace_back([&queue, t, perThread] {
+				for (int i = 0; i < perThread; ++i) {
+					while (!queue.push(t * perThread + i))
+						std::this_thread::yield();
+				}
+			});
+		}
+
+		//       
+		std::vector<int> last(numThreads, -1);
+		int received = 0;
+		bool ordered = true;
+		while (received < numThreads * perThread) {
+			int value;
+			if (!queue.pop(value)) {
+				std::this_thread::yield();
+				continue;
+			}
+			int t = value / perThread;
+			if (value % perThread != last[t] + 1)
+				ordered = false;
+			last[t] = value % perThread;
+			++received;
+		}
+		for (auto& thr : threads)
+			thr.join();
+		if (!ordered || !queue.empty())
+			return false;
+
+		//       
+		sys->postCommand("setrate 1000");
+		if (sys->tickRate() != 0)
+			return false;
+		sys->step();
+		if (sys->tickRate() != 1000)
+			return false;
+		sys->setTickRate(0);
+	}
+
+	//   
+	{
+		int64_t n = 10000;
+		auto created = sys->newEntities<InnerEntity>(n);
+		if (created.size() != n || sys->entityCount() != n)
+			return false;
+		for (int64_t i = 0; i < n; i += 1000) {
+			if (!created[i] || sys->findEntityById(created[i]->id()) != created[i])
+				return false;
+		}
+
+		created.clear();
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+	}
+
+	//  
+	{
+		IdMode previous = sys->idMode();
+		sys->setIdMode(IdMode::Random);
+		auto random = sys->newEntity<InnerEntity>();
+		sys->setIdMode(IdMode::Compact);
+		auto first = sys->newEntity<InnerEntity>();
+		auto second = sys->newEntity<InnerEntity>();
+		sys->setIdMode(previous);
+
+		if (first->id() == second->id())
+			return false;
+		if (sys->findEntityById(first->id()) != first || sys->findEntityById(second->id()) != second)
+			return false;
+
+		//       
+		std::string token = sys->idToString(second->id());
+		if (!sys->idMatches(second->id(), token) || sys->idMatches(first->id(), token))
+			return false;
+		if (std::to_string(std::stoull(token)) != token)
+			return false;
+
+		//  -    
+		token = sys->idToString(random->id()).substr(0, 8);
+		if (!sys->idMatches(random->id(), token))
+			return false;
+
+		//         
+		sys->setIdMode(IdMode::Compact);
+		auto many = sys->newEntities<Entity>(10000);
+		sys->setIdMode(previous);
+		std::set<size_t> buckets;
+		for (const auto& ent : many) {
+			if (sys->findEntityById(ent->id()) != ent)
+				return false;
+			buckets.insert(UidHash()(ent->id()) & 1023);
+		}
+		if (buckets.size() < 1000)
+			return false;
+
+		many.clear();
+		random.reset();
+		first.reset();
+		second.reset();
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+	}
+
+	//    
+	{
+		//    ,    
+		auto pool = std::make_shared<SlabPool>(16);
+		std::vector<std::shared_ptr<InnerEntity>> ents;
+		for (int i = 0; i < 100; ++i)
+			ents.push_back(std::allocate_shared<InnerEntity>(PoolAllocator<InnerEntity>(pool), sys));
+		size_t slabs = pool->slabCount();
+		if (slabs == 0 || pool->blockSize() < sizeof(InnerEntity))
+			return false;
+		for (int round = 0; round < 10; ++round) {
+			ents.clear();
+			for (int i = 0; i < 100; ++i)
+				ents.push_back(std::allocate_shared<InnerEntity>(PoolAllocator<InnerEntity>(pool), sys));
+		}
+		if (pool->slabCount() != slabs)
+			return false;
+
+		//         
+		std::weak_ptr<SlabPool> weakPool = pool;
+		pool.reset();
+		if (weakPool.expired())
+			return false;
+		ents.clear();
+		if (!weakPool.expired())
+			return false;
+
+		// ,  ,   
+		auto created = sys->newEntities<InnerEntity>(1000);
+		sys->removeEntities();
+		created.clear();
+		created = sys->newEntities<InnerEntity>(1000);
+		if (sys->entityCount() != 1000)
+			return false;
+		created.clear();
+		sys->removeEntities();
+	}
+
+	//    
+	{
+		sys->registerEntity<Transient>();
+		sys->setRecyclePoolSize<Transient>(10);
+
+		std::set<Entity*> objects;
+		std::set<uid> ids;
+		for (int i = 0; i < 20; ++i) {
+			auto ent = sys->newEntity<Transient>();
+			ent->value = i + 1;
+			ent->as<Executable>()->setActive();
+			objects.insert(ent.get());
+			ids.insert(ent->id());
+		}
+		sys->removeEntities();
+		if (sys->recycledCount(TYPEID(Transient)) != 10)
+			return false;
+
+		//    , init()  
+		auto reused = sys->newEntities<Transient>(5);
+		for (auto& ent : reused) {
+			if (objects.count(ent.get()) == 0 || ids.count(ent->id()) != 0)
+				return false;
+			if (ent->resets != 1 || ent->inits != 2 || ent->value != 0)
+				return false;
+			if (ent->as<Executable>()->isActive())
+				return false;
+			if (sys->findEntityById(ent->id()) != ent)
+				return false;
+		}
+		if (sys->recycledCount(TYPEID(Transient)) != 5)
+			return false;
+
+		//  ,    ,    
+		sys->removeEntity(reused[0]->id());
+		if (sys->recycledCount(TYPEID(Transient)) != 5)
+			return false;
+
+		reused.clear();
+		sys->removeEntities();
+		sys->setRecyclePoolSize<Transient>(0);
+		if (sys->recycledCount(TYPEID(Transient)) != 0 || sys->entityCount() != 0)
+			return false;
+		sys->unregisterEntity<Transient>();
+	}
+
+	//  
+	{
+		static_assert(std::is_trivially_copyable<EntityHandle>::value, "EntityHandle must be trivially copyable");
+
+		auto worker = sys->newEntity<Worker>();
+		EntityHandle handle = worker->handle();
+		if (handle.isNull() || !sys->isValid(handle) || sys->entity(handle) != worker.get())
+			return false;
+		if (sys->entity<Worker>(handle) != worker.get() || sys->lock(handle) != worker)
+			return false;
+		if (sys->findEntityHandle(worker->id()) != handle)
+			return false;
+
+		//       
+		EntityHandle exeHandle = worker->facetHandle<Executable>();
+		if (exeHandle.isNull() || sys->entity(exeHandle) != worker->facet<Executable>())
+			return false;
+		if (sys->entity<Executable>(handle) != worker->facet<Executable>())
+			return false;
+		if (worker->facet<Spatial>() != nullptr || !worker->facetHandle<Spatial>().isNull())
+			return false;
+
+		auto other = sys->newEntity<InnerEntity>();
+		std::vector<EntityHandle> handles = sys->entityHandles();
+		if (handles.size() != 2)
+			return false;
+
+		//      
+		sys->removeEntity(handle);
+		if (sys->entityCount() != 1)
+			return false;
+		worker.reset();
+		if (sys->isValid(handle) || sys->isValid(exeHandle) || sys->entity(handle) != nullptr)
+			return false;
+
+		//      
+		sys->setRecyclePoolSize<InnerEntity>(1);
+		EntityHandle old = other->handle();
+		EntityHandle oldFacet = other->facetHandle<Spatial>();
+		Entity* object = other.get();
+		other.reset();
+		sys->removeEntities();
+		auto reused = sys->newEntity<InnerEntity>();
+		if (reused.get() != object || reused->handle() == old || sys->isValid(old) || !sys->isValid(reused->handle()))
+			return false;
+		//     
+		EntityHandle newFacet = reused->facetHandle<Spatial>();
+		if (newFacet == oldFacet || sys->isValid(oldFacet) || sys->entity<Spatial>(oldFacet) != nullptr)
+			return false;
+		if (sys->entity<Spatial>(newFacet) != reused->facet<Spatial>())
+			return false;
+
+		reused.reset();
+		sys->setRecyclePoolSize<InnerEntity>(0);
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+	}
+
+	//      for
+	{
+		int n = 10;
+		auto ents = sys->newEntities<InnerEntity>(n);
+		sys->newEntities<Spatial>(n);
+		for (int i = 0; i < n; ++i)
+			ents[i]->as<Enumerable>()->num = i;
+
+		int count = 0;
+		for (Entity& ent : sys->children()) {
+			(void)ent;
+			++count;
+		}
+		if (count != 2 * n)
+			return false;
+
+		// InnerEntity   Spatial,     
+		count = 0;
+		for (Spatial& sp : sys->children<Spatial>()) {
+			sp.setSize(1.0);
+			++count;
+		}
+		if (count != 2 * n)
+			return false;
+
+		//       
+		int sum = 0;
+		for (Enumerable& en : sys->children<Enumerable>([](Enumerable& e) { return e.num % 2 == 0; }))
+			sum += en.num;
+		if (sum != 0 + 2 + 4 + 6 + 8)
+			return false;
+
+		ents.clear();
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+	}
+
+	//  
+	{
+		sys->setSpatialIndex(true);
+		auto sps = sys->newEntities<Spatial>(5);
+		for (int i = 0; i < 5; ++i) {
+			sps[i]->setPosition(point3d(10.0 * i, 0, 0));
+			sps[i]->setSize(1.0);
+		}
+
+		if (sys->queryRadius(point3d(0, 0, 0), 10.0).size() != 2)
+			return false;
+		if (sys->queryBox(point3d(15, -1, -1), point3d(35, 1, 1)).size() != 2)
+			return false;
+		std::vector<EntityHandle> near = sys->nearest(point3d(41, 0, 0), 2);
+		if (near.size() != 2 || (sys->entity(near[0]) != sps[4].get() && sys->entity(near[1]) != sps[4].get()))
+			return false;
+
+		//     
+		sps[4]->setPosition(point3d(-5, 0, 0));
+		if (sys->queryRadius(point3d(0, 0, 0), 5.0).size() != 2)
+			return false;
+		if (sys->queryBox(point3d(39, -1, -1), point3d(41, 1, 1)).size() != 0)
+			return false;
+
+		//  Spatial    
+		auto inner = sys->newEntity<InnerEntity>();
+		inner->as<Spatial>()->setPosition(point3d(100, 100, 100));
+		std::vector<EntityHandle> found = sys->queryRadius(point3d(100, 100, 100), 1.0);
+		if (found.size() != 1 || found[0] != inner->facetHandle<Spatial>())
+			return false;
+
+		//     
+		EntityHandle removed = sps[0]->handle();
+		sps[0].reset();
+		sys->removeEntity(removed);
+		if (sys->queryRadius(point3d(0, 0, 0), 5.0).size() != 1)
+			return false;
+
+		//        
+		sys->setSpatialIndex(false);
+		if (!sys->queryRadius(point3d(0, 0, 0), 1000.0).empty())
+			return false;
+		sys->setSpatialIndex(true);
+		if (sys->nearest(point3d(0, 0, 0), 100).size() != 5)
+			return false;
+
+		sys->setSpatialIndex(false);
+		sps.clear();
+		inner.reset();
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+	}
+
+	//      
+	{
+		sys->setSpatialGrid(true);
+		//     1.5      
+		auto sps = sys->newEntities<Spatial>(8);
+		for (int i = 0; i < 5; ++i) {
+			sps[i]->setPosition(point3d(1.5 * i, 0, 0));
+			sps[i]->setSize(0.5);
+		}
+		for (int i = 5; i < 8; ++i) {
+			sps[i]->setPosition(point3d(100 + 0.1 * i, -50, 20));
+			sps[i]->setSize(0.25);
+		}
+		sys->updateSpatialGrid();
+
+		std::set<std::pair<Spatial*, Spatial*>> pairs;
+		int calls = 0;
+		auto collect = [&](Spatial& a, Spatial& b) {
+			++calls;
+			pairs.insert(std::make_pair(std::min(&a, &b), std::max(&a, &b)));
+		};
+
+		//         0.5
+		sys->forEachNeighborPair(0.5, collect);
+		if (calls != 4 + 3 || pairs.size() != 7)
+			return false;
+
+		//   -  2.0
+		calls = 0;
+		pairs.clear();
+		sys->forEachNeighborPair(2.0, collect);
+		if (calls != 4 + 3 + 3 || pairs.size() != 10)
+			return false;
+
+		//      
+		sps[4]->setPosition(point3d(-1.5, 0, 0));
+		sys->step();
+		calls = 0;
+		sys->forEachNeighborPair(0.5, collect);
+		if (calls != 4 + 3)
+			return false;
+
+		//      
+		sps.pop_back();
+		sys->removeEntities();
+		sps.clear();
+		calls = 0;
+		sys->forEachNeighborPair(10.0, collect);
+		if (calls != 0)
+			return false;
+
+		//       ,   
+		//    
+		std::vector<double> xs = { 0.0, 0.3, 2097152.0, 2097152.3, 1e12, 1e12 + 0.3, -1e15, 1e300, -1e300 };
+		sps = sys->newEntities<Spatial>(xs.size());
+		for (size_t i = 0; i < xs.size(); ++i)
+			sps[i]->setPosition(point3d(xs[i], 0, 0));
+		sys->updateSpatialGrid();
+		calls = 0;
+		pairs.clear();
+		sys->forEachNeighborPair(0.5, collect);
+		if (calls != 3 || pairs.size() != 3)
+			return false;
+
+		//    :   -   
+		sys->removeEntities();
+		sps = sys->newEntities<Spatial>(6);
+		for (int i = 0; i < 6; ++i)
+			sps[i]->setPosition(point3d(i, 0.5 * i, 0));
+		sys->updateSpatialGrid();
+		calls = 0;
+		pairs.clear();
+		sys->forEachNeighborPair(1000.0, collect);
+		if (calls != 15 || pairs.size() != 15)
+			return false;
+
+		//       :  
+		//        
+		sys->setThreadCount(4);
+		auto found = std::make_shared<std::atomic<int>>(0);
+		std::vector<std::shared_ptr<Worker>> searchers;
+		for (int i = 0; i < 8; ++i) {
+			searchers.push_back(sys->newEntity<Worker>());
+			auto exe = searchers.back()->as<Executable>();
+			exe->setStepFunction([sys, found, i] {
+				sys->forEachNeighborPair(2000.0 + 1000.0 * i, [found](Spatial&, Spatial&) { ++*found; });
+			});
+			exe->setActive();
+		}
+		sys->step();
+		if (*found != 8 * 15)
+			return false;
+		sys->setThreadCount(1);
+
+		searchers.clear();
+		sps.clear();
+		sys->removeEntities();
+		sys->setSpatialGrid(false);
+	}
+
+	//     
+	{
+		size_t before = sys->spatialView().size;
+		auto sps = sys->newEntities<Spatial>(3);
+		for (int i = 0; i < 3; ++i) {
+			sps[i]->setPosition(point3d(i, 2 * i, 3 * i));
+			sps[i]->setSize(i + 0.5);
+		}
+
+		SpatialView view = sys->spatialView();
+		if (view.size != before + 3)
+			return false;
+		for (int i = 0; i < 3; ++i) {
+			size_t row = sps[i]->row();
+			if (view.objects[row] != sps[i].get() || view.x[row] != i || view.z[row] != 3 * i || view.sizes[row] != i + 0.5)
+				return false;
+			//       
+			view.y[row] = 7.0;
+			view.orientZ[row] = 1.0;
+			if (bg::get<1>(sps[i]->position()) != 7.0 || bg::get<2>(sps[i]->orientation()) != 1.0)
+				return false;
+		}
+
+		//      
+		EntityHandle first = sps[0]->handle();
+		sps.erase(sps.begin());
+		sys->removeEntity(first);
+		view = sys->spatialView();
+		if (view.size != before + 2)
+			return false;
+		for (size_t i = 0; i < sps.size(); ++i) {
+			size_t row = sps[i]->row();
+			if (row >= view.size || view.objects[row] != sps[i].get() || view.x[row] != i + 1)
+				return false;
+		}
+
+		sps.clear();
+		sys->removeEntities();
+		if (sys->spatialView().size != before)
+			return false;
+	}
+
+	//        
+	{
+		Batch::SimdLevel previous = Batch::simdLevel();
+		const size_t n = 11; //    ,   
+		for (int level = 0; level <= static_cast<int>(Batch::supportedSimdLevel()); ++level) {
+			Batch::setSimdLevel(static_cast<Batch::SimdLevel>(level));
+			std::vector<double> ax(n), ay(n), az(n), bx(n), by(n), bz(n), out(n);
+			std::vector<point3d> expected(n);
+			for (size_t i = 0; i < n; ++i) {
+				ax[i] = i; ay[i] = -2.0 * i; az[i] = 0.5 * i;
+				bx[i] = 1.0; by[i] = i; bz[i] = -1.0;
+				expected[i] = (point3d(ax[i], ay[i], az[i]) + point3d(1, 2, 3)) * 2.0 + 0.5 * point3d(bx[i], by[i], bz[i]);
+			}
+			PointArrays a{ n, ax.data(), ay.data(), az.data() };
+			PointArrays b{ n, bx.data(), by.data(), bz.data() };
+
+			Batch::translate(a, point3d(1, 2, 3));
+			Batch::scale(a, 2.0);
+			Batch::axpy(a, 0.5, b);
+			for (size_t i = 0; i < n; ++i) {
+				if (length(point3d(ax[i], ay[i], az[i]) - expected[i]) > 1e-12)
+					return false;
+			}
+
+			Batch::distance(a, b, out.data());
+			for (size_t i = 0; i < n; ++i) {
+				if (std::abs(out[i] - length(expected[i] - point3d(bx[i], by[i], bz[i]))) > 1e-12)
+					return false;
+			}
+
+			//      
+			ax[3] = ay[3] = az[3] = 0.0;
+			Batch::normalize(a);
+			Batch::length(a, out.data());
+			for (size_t i = 0; i < n; ++i) {
+				if (std::abs(out[i] - (i == 3 ? 0.0 : 1.0)) > 1e-12)
+					return false;
+			}
+		}
+		Batch::setSimdLevel(previous);
+		if (Batch::simdLevel() != previous)
+			return false;
+	}
+
+	//     
+	{
+		const double pi = 3.14159265358979323846;
+		auto near = [](const point3d& a, const point3d& b) { return length(a - b) < 1e-9; };
+
+		auto top = sys->newEntity<Spatial>();
+		top->setPosition(point3d(10, 0, 0));
+		top->setOrientation(point3d(0, 0, pi / 2));
+		auto child = top->newEntity<Spatial>();
+		child->setPosition(point3d(1, 0, 0));
+		//        
+		auto group = top->newEntity<Entity>();
+		auto grand = group->newEntity<Spatial>();
+		grand->setPosition(point3d(0, 2, 0));
+		auto inner = child->newEntity<InnerEntity>();
+		inner->as<Spatial>()->setPosition(point3d(0, 0, 1));
+		inner->as<Spatial>()->setOrientation(point3d(pi / 4, 0, 0));
+
+		sys->updateWorldTransforms();
+		if (!near(top->worldPosition(), point3d(10, 0, 0)) || !near(child->worldPosition(), point3d(10, 1, 0)))
+			return false;
+		if (!near(grand->worldPosition(), point3d(8, 0, 0)) || !near(child->worldOrientation(), point3d(0, 0, pi / 2)))
+			return false;
+		if (!near(inner->as<Spatial>()->worldPosition(), point3d(10, 1, 1)))
+			return false;
+		if (!near(inner->as<Spatial>()->worldOrientation(), point3d(pi / 4, 0, pi / 2)))
+			return false;
+
+		//        
+		top->setPosition(point3d(0, 0, 0));
+		top->setOrientation(point3d(0, 0, 0));
+		if (!near(child->worldPosition(), point3d(10, 1, 0)))
+			return false;
+		sys->step();
+		if (!near(child->worldPosition(), point3d(1, 0, 0)) || !near(grand->worldPosition(), point3d(0, 2, 0)))
+			return false;
+		if (!near(inner->as<Spatial>()->worldPosition(), point3d(1, 0, 1)))
+			return false;
+
+		//      
+		SpatialView view = sys->spatialView();
+		view.x[top->row()] = 5.0;
+		sys->invalidateWorldTransforms();
+		sys->updateWorldTransforms();
+		if (!near(grand->worldPosition(), point3d(5, 2, 0)))
+			return false;
+
+		inner.reset();
+		grand.reset();
+		group.reset();
+		child.reset();
+		top.reset();
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+	}
+
+	//       
+	{
+		Spatial loose(nullptr);
+		loose.setPosition(point3d(1, 2, 3));
+		loose.setSize(0.5);
+		if (length(loose.position() - point3d(1, 2, 3)) != 0.0 || loose.size() != 0.5)
+			return false;
+		if (length(loose.worldPosition() - point3d(1, 2, 3)) != 0.0)
+			return false;
+	}
+
+	//            
+	{
+		sys->setThreadCount(4);
+
+		int n = 40;
+		auto ran = std::make_shared<std::atomic<int>>(0);
+		std::vector<std::shared_ptr<Worker>> workers;
+		for (int i = 0; i < n; ++i)
+			workers.push_back(std::static_pointer_cast<Worker>(sys->newEntity<Worker>()));
+		for (int i = 0; i < n; ++i) {
+			Executable* exe = workers[i]->as<Executable>().get();
+			Executable* partner = workers[(i + 1) % n]->as<Executable>().get();
+			EntityHandle victim = sys->findEntityHandle(workers[(i + 2) % n]->id());
+			//    ,      
+			exe->setStepFunction([sys, exe, partner, victim, ran] {
+				++*ran;
+				partner->setActive(false);
+				sys->removeEntity(victim);
+				exe->setPeriod(2);
+			});
+			exe->setActive();
+		}
+
+		//     ,     
+		sys->step();
+		if (*ran != n)
+			return false;
+		for (const auto& worker : workers) {
+			if (worker->as<Executable>()->isActive() || worker->as<Executable>()->period() != 2)
+				return false;
+		}
+		if (sys->entityCount() != 0)
+			return false;
+
+		sys->setThreadCount(1);
+	}
+
+	//     
+	{
+		std::vector<int> order;
+		sys->setHierarchicalStepping(true);
+		auto outer = sys->newEntity<Worker>();
+		auto inner = outer->newEntity<InnerEntity>();
+		auto innermost = inner->newEntity<Worker>();
+		outer->as<Executable>()->setStepFunction([&order] { order.push_back(1); });
+		outer->as<Executable>()->setActive();
+		innermost->as<Executable>()->setStepFunction([&order] { order.push_back(3); });
+		innermost->as<Executable>()->setActive();
+		sys->step();
+		if (order != std::vector<int>({ 1, 3 }))
+			return false;
+
+		//         
+		order.clear();
+		auto plain = outer->newEntity<InnerEntity>();
+		outer->removeEntity(plain->id());
+		sys->step();
+		if (order != std::vector<int>({ 1, 3 }))
+			return false;
+
+		//         
+		order.clear();
+		outer->removeEntity(inner->id());
+		sys->step();
+		if (order != std::vector<int>({ 1 }))
+			return false;
+
+		sys->setHierarchicalStepping(false);
+		plain.reset();
+		inner.reset();
+		innermost.reset();
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+	}
+
+	//         
+	{
+		sys->setThreadCount(4);
+
+		int n = 64;
+		std::vector<std::shared_ptr<Spatial>> tops;
+		std::vector<std::shared_ptr<Spatial>> children;
+		std::vector<std::shared_ptr<Worker>> movers;
+		for (int i = 0; i < n; ++i) {
+			tops.push_back(sys->newEntity<Spatial>());
+			children.push_back(tops.back()->newEntity<Spatial>());
+			children.back()->setPosition(point3d(0, 1, 0));
+		}
+		sys->updateWorldTransforms();
+
+		for (int i = 0; i < n; ++i) {
+			movers.push_back(sys->newEntity<Worker>());
+			Spatial* top = tops[i].get();
+			Spatial* child = children[i].get();
+			auto exe = movers.back()->as<Executable>();
+			//         
+			exe->setStepFunction([top, child, i] {
+				for (int k = 0; k <= 10; ++k)
+					top->setPosition(point3d(k, 0, i));
+				child->setPosition(point3d(0, 2, 0));
+			});
+			exe->setActive();
+		}
+
+		sys->step();
+		sys->updateWorldTransforms();
+		for (int i = 0; i < n; ++i) {
+			if (length(children[i]->worldPosition() - point3d(10, 2, i)) != 0.0)
+				return false;
+		}
+
+		sys->setThreadCount(1);
+		movers.clear();
+		children.clear();
+		tops.clear();
+		sys->removeEntities();
+		if (sys->entityCount() != 0)
+			return false;
+	}
+
+	//         
+	{
+		FacetMask mask;
+		mask.set(InvalidTypeId);
+		mask.set(MaxEntityTypes);
+		mask.reset(MaxEntityTypes + 1);
+		if (!mask.none() || mask.test(InvalidTypeId))
+			return false;
+		mask.set(3);
+		if (mask.rank(InvalidTypeId) != 1 || mask.rank(3) != 0)
+			return false;
+
+		auto worker = sys->newEntity<Worker>();
+		auto exe = worker->as<Executable>();
+		exe->reads(InvalidTypeId);
+		exe->writes(MaxEntityTypes + 10);
+		exe->setActive();
+		sys->step();
+		if (worker->steps != 1)
+			return false;
+
+		worker.reset();
+		sys->removeEntities();
+	}
+
 	int i = 0;
 	auto ent = sys->newEntity(TYPEID(OuterEntity));
 	for (auto iter = ent->entityIterator(); iter.hasMore(); iter.next()) {
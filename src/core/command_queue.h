@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace Basis
+{
+	/// @brief Ограниченная очередь без блокировок: много писателей, один читатель.
+	///
+	/// Кольцевой буфер по схеме Д. Вьюкова. Каждая ячейка хранит порядковый номер,
+	/// по которому писатель узнаёт, свободна ли ячейка, а читатель - заполнена ли она.
+	/// Писатели резервируют ячейку сравнением с обменом позиции записи; читатель
+	/// единственный, поэтому позицию чтения он продвигает без атомарных операций.
+	template <class T>
+	class MpscQueue
+	{
+	public:
+		/// @brief Создать очередь; ёмкость округляется вверх до степени двойки.
+		explicit MpscQueue(size_t capacity)
+		{
+			size_t cap = 2;
+			while (cap < capacity)
+				cap *= 2;
+
+			_cells.reset(new Cell[cap]);
+			_mask = cap - 1;
+			for (size_t i = 0; i < cap; ++i)
+				_cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
+		MpscQueue(const MpscQueue&) = delete;
+		MpscQueue& operator=(const MpscQueue&) = delete;
+
+		/// @brief Поместить элемент в очередь (из любого потока).
+		/// @return false, если очередь заполнена
+		bool push(T value)
+		{
+			Cell* cell;
+			size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+			for (;;) {
+				cell = &_cells[pos & _mask];
+				size_t seq = cell->sequence.load(std::memory_order_acquire);
+				intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+				if (dif == 0) {
+					if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (dif < 0) {
+					return false;
+				}
+				else {
+					pos = _enqueuePos.load(std::memory_order_relaxed);
+				}
+			}
+
+			cell->value = std::move(value);
+			cell->sequence.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		/// @brief Извлечь элемент из очереди (только из потока-читателя).
+		/// @return false, если очередь пуста
+		bool pop(T& value)
+		{
+			Cell& cell = _cells[_dequeuePos & _mask];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			if (static_cast<intptr_t>(seq) - static_cast<intptr_t>(_dequeuePos + 1) < 0)
+				return false;
+
+			value = std::move(cell.value);
+			cell.value = T();
+			cell.sequence.store(_dequeuePos + _mask + 1, std::memory_order_release);
+			++_dequeuePos;
+			return true;
+		}
+
+		/// @brief Пуста ли очередь (только из потока-читателя).
+		bool empty() const
+		{
+			const Cell& cell = _cells[_dequeuePos & _mask];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			return static_cast<intptr_t>(seq) - static_cast<intptr_t>(_dequeuePos + 1) < 0;
+		}
+
+		size_t capacity() const { return _mask + 1; }
+
+	private:
+		struct Cell
+		{
+			std::atomic<size_t> sequence;
+			T value;
+		};
+
+		std::unique_ptr<Cell[]> _cells;
+		size_t _mask = 0;
+		char _pad0[64];                          /// позиции записи и чтения - в разных строках кэша
+		std::atomic<size_t> _enqueuePos = { 0 }; /// позиция записи (общая для писателей)
+		char _pad1[64];
+		size_t _dequeuePos = 0;                  /// позиция чтения (только читатель)
+	};
+};
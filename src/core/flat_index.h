@@ -0,0 +1,228 @@
+#pragma once
+
+#include "basis.h"
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <boost/utility/string_view.hpp>
+
+namespace Basis
+{
+	/// @brief Хеш UUID, вычисляемый непосредственно по его 128 битам.
+	struct UidHash
+	{
+		size_t operator()(const uid& id) const
+		{
+			uint64_t lo, hi;
+			std::memcpy(&lo, id.data, sizeof(lo));
+			std::memcpy(&hi, id.data + sizeof(lo), sizeof(hi));
+			// в компактных идентификаторах меняются лишь несколько байтов одной
+			// половины, поэтому все биты результата перемешиваются (fmix64 из MurmurHash3)
+			uint64_t h = lo ^ ((hi << 32) | (hi >> 32));
+			h ^= h >> 33;
+			h *= 0xFF51AFD7ED558CCDull;
+			h ^= h >> 33;
+			h *= 0xC4CEB9FE1A85EC53ull;
+			h ^= h >> 33;
+			return static_cast<size_t>(h);
+		}
+	};
+
+	/// @brief Хеш строки (FNV-1a), одинаковый для std::string и string_view.
+	struct NameHash
+	{
+		size_t operator()(boost::string_view str) const
+		{
+			uint64_t h = 14695981039346656037ull;
+			for (char c : str) {
+				h ^= static_cast<unsigned char>(c);
+				h *= 1099511628211ull;
+			}
+			return static_cast<size_t>(h);
+		}
+	};
+
+	struct NameEqual
+	{
+		bool operator()(const std::string& a, boost::string_view b) const
+		{
+			return boost::string_view(a) == b;
+		}
+	};
+
+	/// @brief Хеш-индекс с открытой адресацией (линейное пробирование).
+	///
+	/// Допускает несколько записей с одинаковым ключом. При удалении записи
+	/// следующие за ней записи сдвигаются назад, поэтому "надгробий" нет и
+	/// размер таблицы определяется только максимальным числом живых записей.
+	/// Поиск допускает ключи любого типа, для которого определены Hash и Equal
+	/// (например, string_view для таблицы со строковыми ключами).
+	template <class K, class V, class Hash, class Equal = std::equal_to<K>>
+	class FlatIndex
+	{
+	public:
+		/// @brief Добавить запись (ключ, значение).
+		void insert(const K& key, const V& value)
+		{
+			if ((_size + 1) * 4 > _buckets.size() * 3)
+				rehash(_buckets.empty() ? 16 : _buckets.size() * 2);
+
+			size_t h = Hash()(key);
+			size_t mask = _buckets.size() - 1;
+			size_t i = h & mask;
+			while (_buckets[i].used)
+				i = (i + 1) & mask;
+
+			_buckets[i].used = true;
+			_buckets[i].hash = h;
+			_buckets[i].key = key;
+			_buckets[i].value = value;
+			++_size;
+		}
+
+		/// @brief Найти первую запись с данным ключом.
+		template <class Key>
+		V* find(const Key& key)
+		{
+			if (_size == 0)
+				return nullptr;
+
+			size_t h = Hash()(key);
+			size_t mask = _buckets.size() - 1;
+			for (size_t i = h & mask; _buckets[i].used; i = (i + 1) & mask) {
+				if (_buckets[i].hash == h && Equal()(_buckets[i].key, key))
+					return &_buckets[i].value;
+			}
+
+			return nullptr;
+		}
+
+		/// @brief Вызвать func для значения каждой записи с данным ключом.
+		template <class Key, class Func>
+		void forEach(const Key& key, Func func) const
+		{
+			if (_size == 0)
+				return;
+
+			size_t h = Hash()(key);
+			size_t mask = _buckets.size() - 1;
+			for (size_t i = h & mask; _buckets[i].used; i = (i + 1) & mask) {
+				if (_buckets[i].hash == h && Equal()(_buckets[i].key, key))
+					func(_buckets[i].value);
+			}
+		}
+
+		/// @brief Удалить запись с данными ключом и значением.
+		template <class Key>
+		bool erase(const Key& key, const V& value)
+		{
+			if (_size == 0)
+				return false;
+
+			size_t h = Hash()(key);
+			size_t mask = _buckets.size() - 1;
+			for (size_t i = h & mask; _buckets[i].used; i = (i + 1) & mask) {
+				if (_buckets[i].hash == h && _buckets[i].value == value && Equal()(_buckets[i].key, key)) {
+					eraseAt(i);
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		/// @brief Удалить первую запись с данным ключом.
+		template <class Key>
+		bool erase(const Key& key)
+		{
+			if (_size == 0)
+				return false;
+
+			size_t h = Hash()(key);
+			size_t mask = _buckets.size() - 1;
+			for (size_t i = h & mask; _buckets[i].used; i = (i + 1) & mask) {
+				if (_buckets[i].hash == h && Equal()(_buckets[i].key, key)) {
+					eraseAt(i);
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		/// @brief Зарезервировать место под n записей.
+		void reserve(size_t n)
+		{
+			size_t cap = 16;
+			while (n * 4 > cap * 3)
+				cap *= 2;
+			if (cap > _buckets.size())
+				rehash(cap);
+		}
+
+		/// @brief Удалить все записи и освободить память.
+		void clear()
+		{
+			std::vector<Bucket>().swap(_buckets);
+			_size = 0;
+		}
+
+		size_t size() const { return _size; }
+
+	private:
+		struct Bucket
+		{
+			K key = K();
+			V value = V();
+			size_t hash = 0;
+			bool used = false;
+		};
+
+		void rehash(size_t capacity)
+		{
+			std::vector<Bucket> old;
+			old.swap(_buckets);
+			_buckets.resize(capacity);
+			size_t mask = capacity - 1;
+			for (Bucket& b : old) {
+				if (!b.used)
+					continue;
+				size_t i = b.hash & mask;
+				while (_buckets[i].used)
+					i = (i + 1) & mask;
+				_buckets[i] = std::move(b);
+			}
+		}
+
+		// Удаление со сдвигом назад: записи, которые при вставке "проскочили"
+		// освобождаемую ячейку, переносятся в неё.
+		void eraseAt(size_t pos)
+		{
+			size_t mask = _buckets.size() - 1;
+			size_t i = pos;
+			size_t j = pos;
+			for (;;) {
+				j = (j + 1) & mask;
+				if (!_buckets[j].used)
+					break;
+				size_t k = _buckets[j].hash & mask;
+				// запись остаётся на месте, если её исходная ячейка лежит в (i, j]
+				if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+					continue;
+				_buckets[i] = std::move(_buckets[j]);
+				i = j;
+			}
+
+			_buckets[i] = Bucket();
+			--_size;
+		}
+
+	private:
+		std::vector<Bucket> _buckets;
+		size_t _size = 0;
+	};
+
+	using UuidIndex = FlatIndex<uid, SlotHandle, UidHash>;
+	using NameIndex = FlatIndex<std::string, SlotHandle, NameHash, NameEqual>;
+};
@@ -0,0 +1,165 @@
+#include "point_kernels.h"
+#include <atomic>
+#include <algorithm>
+
+#if defined(BASIS_X86_SIMD) && defined(_MSC_VER)
+#  include <intrin.h>
+#endif
+
+using namespace Basis;
+using namespace Basis::Batch;
+using namespace std;
+
+namespace
+{
+	struct ScalarOps
+	{
+		using V = double;
+		static const size_t width = 1;
+
+		static V load(const double* p) { return *p; }
+		static void store(double* p, V v) { *p = v; }
+		static V set1(double v) { return v; }
+		static V add(V a, V b) { return a + b; }
+		static V sub(V a, V b) { return a - b; }
+		static V mul(V a, V b) { return a * b; }
+		static V sqrt(V a) { return std::sqrt(a); }
+		static V inverse(V len) { return len > 0.0 ? 1.0 / len : 1.0; }
+	};
+
+#if defined(BASIS_X86_SIMD)
+	struct Sse2Ops
+	{
+		using V = __m128d;
+		static const size_t width = 2;
+
+		static V load(const double* p) { return _mm_loadu_pd(p); }
+		static void store(double* p, V v) { _mm_storeu_pd(p, v); }
+		static V set1(double v) { return _mm_set1_pd(v); }
+		static V add(V a, V b) { return _mm_add_pd(a, b); }
+		static V sub(V a, V b) { return _mm_sub_pd(a, b); }
+		static V mul(V a, V b) { return _mm_mul_pd(a, b); }
+		static V sqrt(V a) { return _mm_sqrt_pd(a); }
+		static V inverse(V len)
+		{
+			// в SSE2 нет выбора по маске, поэтому собираем результат из двух половин
+			V one = _mm_set1_pd(1.0);
+			V positive = _mm_cmpgt_pd(len, _mm_setzero_pd());
+			return _mm_or_pd(_mm_and_pd(positive, _mm_div_pd(one, len)), _mm_andnot_pd(positive, one));
+		}
+	};
+#endif
+
+	bool cpuHasAvx2()
+	{
+#if defined(BASIS_X86_SIMD) && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return false;
+
+		// регистры AVX должны сохраняться операционной системой
+		__cpuid(info, 1);
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		bool avx = (info[2] & (1 << 28)) != 0;
+		if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+			return false;
+
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#elif defined(BASIS_X86_SIMD)
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") != 0;
+#else
+		return false;
+#endif
+	}
+
+	SimdLevel detectLevel()
+	{
+		if (avx2Kernels() && cpuHasAvx2())
+			return SimdLevel::AVX2;
+		if (sse2Kernels())
+			return SimdLevel::SSE2;
+		return SimdLevel::Scalar;
+	}
+
+	std::atomic<int>& levelStorage()
+	{
+		static std::atomic<int> level(static_cast<int>(supportedSimdLevel()));
+		return level;
+	}
+
+	const KernelTable& kernels()
+	{
+		switch (simdLevel()) {
+		case SimdLevel::AVX2:
+			return *avx2Kernels();
+		case SimdLevel::SSE2:
+			return *sse2Kernels();
+		default:
+			return *scalarKernels();
+		}
+	}
+}
+
+const KernelTable* Basis::Batch::scalarKernels()
+{
+	return Kernels<ScalarOps>::table();
+}
+
+const KernelTable* Basis::Batch::sse2Kernels()
+{
+#if defined(BASIS_X86_SIMD)
+	return Kernels<Sse2Ops>::table();
+#else
+	return nullptr;
+#endif
+}
+
+SimdLevel Basis::Batch::supportedSimdLevel()
+{
+	static const SimdLevel level = detectLevel();
+	return level;
+}
+
+SimdLevel Basis::Batch::simdLevel()
+{
+	return static_cast<SimdLevel>(levelStorage().load(memory_order_relaxed));
+}
+
+void Basis::Batch::setSimdLevel(SimdLevel level)
+{
+	level = std::min(level, supportedSimdLevel());
+	levelStorage().store(static_cast<int>(level), memory_order_relaxed);
+}
+
+void Basis::Batch::translate(const PointArrays& points, const point3d& offset)
+{
+	kernels().translate(points, offset.get<0>(), offset.get<1>(), offset.get<2>());
+}
+
+void Basis::Batch::scale(const PointArrays& points, double factor)
+{
+	kernels().scale(points, factor);
+}
+
+void Basis::Batch::axpy(const PointArrays& y, double a, const PointArrays& x)
+{
+	kernels().axpy(y, a, x);
+}
+
+void Basis::Batch::distance(const PointArrays& a, const PointArrays& b, double* out)
+{
+	kernels().distance(a, b, out);
+}
+
+void Basis::Batch::length(const PointArrays& points, double* out)
+{
+	kernels().length(points, out);
+}
+
+void Basis::Batch::normalize(const PointArrays& points)
+{
+	kernels().normalize(points);
+}
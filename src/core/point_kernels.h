@@ -0,0 +1,152 @@
+#pragma once
+
+#include "basis.h"
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#  define BASIS_X86_SIMD
+#  include <immintrin.h>
+#endif
+
+namespace Basis
+{
+namespace Batch
+{
+	/// @brief Таблица реализаций пакетных функций для одного набора команд.
+	struct KernelTable
+	{
+		void (*translate)(const PointArrays& points, double dx, double dy, double dz);
+		void (*scale)(const PointArrays& points, double factor);
+		void (*axpy)(const PointArrays& y, double a, const PointArrays& x);
+		void (*distance)(const PointArrays& a, const PointArrays& b, double* out);
+		void (*length)(const PointArrays& points, double* out);
+		void (*normalize)(const PointArrays& points);
+	};
+
+	/// @brief Реализации на обычных циклах.
+	const KernelTable* scalarKernels();
+	/// @brief Реализации на SSE2 (nullptr, если сборка без них).
+	const KernelTable* sse2Kernels();
+	/// @brief Реализации на AVX2 (nullptr, если сборка без них).
+	const KernelTable* avx2Kernels();
+
+	/// @brief Пакетные функции, записанные через операции над регистром из Ops::width чисел.
+	///
+	/// Ops задаёт тип регистра V и операции load/store/set1/add/sub/mul/sqrt, а также
+	/// inverse(len) - 1 / len для положительных len и 1 для остальных. Хвост
+	/// массива, не кратный ширине регистра, обрабатывается обычным циклом.
+	template <class Ops>
+	struct Kernels
+	{
+		using V = typename Ops::V;
+
+		static void translate(const PointArrays& p, double dx, double dy, double dz)
+		{
+			V vx = Ops::set1(dx), vy = Ops::set1(dy), vz = Ops::set1(dz);
+			size_t i = 0;
+			for (; i + Ops::width <= p.size; i += Ops::width) {
+				Ops::store(p.x + i, Ops::add(Ops::load(p.x + i), vx));
+				Ops::store(p.y + i, Ops::add(Ops::load(p.y + i), vy));
+				Ops::store(p.z + i, Ops::add(Ops::load(p.z + i), vz));
+			}
+			for (; i < p.size; ++i) {
+				p.x[i] += dx;
+				p.y[i] += dy;
+				p.z[i] += dz;
+			}
+		}
+
+		static void scale(const PointArrays& p, double factor)
+		{
+			V f = Ops::set1(factor);
+			size_t i = 0;
+			for (; i + Ops::width <= p.size; i += Ops::width) {
+				Ops::store(p.x + i, Ops::mul(Ops::load(p.x + i), f));
+				Ops::store(p.y + i, Ops::mul(Ops::load(p.y + i), f));
+				Ops::store(p.z + i, Ops::mul(Ops::load(p.z + i), f));
+			}
+			for (; i < p.size; ++i) {
+				p.x[i] *= factor;
+				p.y[i] *= factor;
+				p.z[i] *= factor;
+			}
+		}
+
+		static void axpy(const PointArrays& y, double a, const PointArrays& x)
+		{
+			V va = Ops::set1(a);
+			size_t i = 0;
+			for (; i + Ops::width <= y.size; i += Ops::width) {
+				Ops::store(y.x + i, Ops::add(Ops::load(y.x + i), Ops::mul(va, Ops::load(x.x + i))));
+				Ops::store(y.y + i, Ops::add(Ops::load(y.y + i), Ops::mul(va, Ops::load(x.y + i))));
+				Ops::store(y.z + i, Ops::add(Ops::load(y.z + i), Ops::mul(va, Ops::load(x.z + i))));
+			}
+			for (; i < y.size; ++i) {
+				y.x[i] += a * x.x[i];
+				y.y[i] += a * x.y[i];
+				y.z[i] += a * x.z[i];
+			}
+		}
+
+		static void distance(const PointArrays& a, const PointArrays& b, double* out)
+		{
+			size_t i = 0;
+			for (; i + Ops::width <= a.size; i += Ops::width) {
+				V dx = Ops::sub(Ops::load(a.x + i), Ops::load(b.x + i));
+				V dy = Ops::sub(Ops::load(a.y + i), Ops::load(b.y + i));
+				V dz = Ops::sub(Ops::load(a.z + i), Ops::load(b.z + i));
+				Ops::store(out + i, Ops::sqrt(norm2(dx, dy, dz)));
+			}
+			for (; i < a.size; ++i) {
+				double dx = a.x[i] - b.x[i];
+				double dy = a.y[i] - b.y[i];
+				double dz = a.z[i] - b.z[i];
+				out[i] = std::sqrt(dx * dx + dy * dy + dz * dz);
+			}
+		}
+
+		static void length(const PointArrays& p, double* out)
+		{
+			size_t i = 0;
+			for (; i + Ops::width <= p.size; i += Ops::width)
+				Ops::store(out + i, Ops::sqrt(norm2(Ops::load(p.x + i), Ops::load(p.y + i), Ops::load(p.z + i))));
+			for (; i < p.size; ++i)
+				out[i] = std::sqrt(p.x[i] * p.x[i] + p.y[i] * p.y[i] + p.z[i] * p.z[i]);
+		}
+
+		static void normalize(const PointArrays& p)
+		{
+			size_t i = 0;
+			for (; i + Ops::width <= p.size; i += Ops::width) {
+				V x = Ops::load(p.x + i);
+				V y = Ops::load(p.y + i);
+				V z = Ops::load(p.z + i);
+				V inv = Ops::inverse(Ops::sqrt(norm2(x, y, z)));
+				Ops::store(p.x + i, Ops::mul(x, inv));
+				Ops::store(p.y + i, Ops::mul(y, inv));
+				Ops::store(p.z + i, Ops::mul(z, inv));
+			}
+			for (; i < p.size; ++i) {
+				double len = std::sqrt(p.x[i] * p.x[i] + p.y[i] * p.y[i] + p.z[i] * p.z[i]);
+				if (len > 0.0) {
+					p.x[i] /= len;
+					p.y[i] /= len;
+					p.z[i] /= len;
+				}
+			}
+		}
+
+		static const KernelTable* table()
+		{
+			static const KernelTable t = { translate, scale, axpy, distance, length, normalize };
+			return &t;
+		}
+
+	private:
+		static V norm2(V x, V y, V z)
+		{
+			return Ops::add(Ops::add(Ops::mul(x, x), Ops::mul(y, y)), Ops::mul(z, z));
+		}
+	};
+} // namespace Batch
+} // namespace Basis
@@ -0,0 +1,45 @@
+// Файл собирается с включённым AVX2 (см. CMakeLists.txt); функции отсюда
+// вызываются, только если процессор поддерживает AVX2.
+#include "point_kernels.h"
+
+using namespace Basis;
+using namespace Basis::Batch;
+
+#if defined(BASIS_X86_SIMD) && defined(__AVX2__)
+
+namespace
+{
+	struct Avx2Ops
+	{
+		using V = __m256d;
+		static const size_t width = 4;
+
+		static V load(const double* p) { return _mm256_loadu_pd(p); }
+		static void store(double* p, V v) { _mm256_storeu_pd(p, v); }
+		static V set1(double v) { return _mm256_set1_pd(v); }
+		static V add(V a, V b) { return _mm256_add_pd(a, b); }
+		static V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+		static V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+		static V sqrt(V a) { return _mm256_sqrt_pd(a); }
+		static V inverse(V len)
+		{
+			V one = _mm256_set1_pd(1.0);
+			V positive = _mm256_cmp_pd(len, _mm256_setzero_pd(), _CMP_GT_OQ);
+			return _mm256_blendv_pd(one, _mm256_div_pd(one, len), positive);
+		}
+	};
+}
+
+const KernelTable* Basis::Batch::avx2Kernels()
+{
+	return Kernels<Avx2Ops>::table();
+}
+
+#else
+
+const KernelTable* Basis::Batch::avx2Kernels()
+{
+	return nullptr;
+}
+
+#endif
@@ -0,0 +1,178 @@
+#include "scheduler.h"
+#include <algorithm>
+
+using namespace Basis;
+using namespace std;
+
+// номер очереди, которую обслуживает поток (задаётся в рабочих потоках)
+static thread_local size_t workerSlot = 0;
+
+Scheduler::Scheduler()
+{
+	_queues.push_back(make_unique<Queue>());
+}
+
+Scheduler::~Scheduler()
+{
+	stopThreads();
+}
+
+void Scheduler::setThreadCount(int n)
+{
+	if (n < 1)
+		n = 1;
+	if (n == threadCount())
+		return;
+
+	stopThreads();
+
+	_queues.clear();
+	for (int i = 0; i < n; ++i)
+		_queues.push_back(make_unique<Queue>());
+
+	_stop = false;
+	for (int i = 1; i < n; ++i)
+		_threads.emplace_back([this, i] { threadFunc(i); });
+}
+
+int Scheduler::threadCount() const
+{
+	return static_cast<int>(_threads.size()) + 1;
+}
+
+size_t Scheduler::currentSlot()
+{
+	return workerSlot;
+}
+
+void Scheduler::parallelFor(size_t n, const std::function<void(size_t)>& func)
+{
+	if (n == 0)
+		return;
+
+	// вызов из рабочего потока, а также из любого потока во время другого
+	// задания выполняется последовательно: пул обслуживает одно задание
+	if (_threads.empty() || n == 1 || workerSlot != 0 || _running.exchange(true)) {
+		for (size_t i = 0; i < n; ++i)
+			func(i);
+		return;
+	}
+
+	// задание публикуется до того, как в очередях появятся диапазоны
+	_func = &func;
+	size_t slots = _queues.size();
+	_grain = std::max<size_t>(1, n / (slots * 8));
+	_remaining = n;
+	for (size_t k = 0; k < slots; ++k) {
+		Range range = { n * k / slots, n * (k + 1) / slots };
+		if (range.begin < range.end)
+			push(k, range);
+	}
+
+	{
+		lock_guard<mutex> lock(_mutex);
+		++_generation;
+	}
+	_wake.notify_all();
+
+	work(0);
+
+	// барьер: рабочие потоки должны закончить обращаться к заданию
+	while (_busy.load() != 0)
+		this_thread::yield();
+
+	_func = nullptr;
+	_running = false;
+}
+
+void Scheduler::threadFunc(size_t slot)
+{
+	workerSlot = slot;
+	uint64_t seen = 0;
+	for (;;) {
+		{
+			unique_lock<mutex> lock(_mutex);
+			_wake.wait(lock, [&] { return _stop || _generation != seen; });
+			if (_stop)
+				return;
+			seen = _generation;
+			++_busy;
+		}
+
+		work(slot);
+		--_busy;
+	}
+}
+
+void Scheduler::work(size_t slot)
+{
+	while (_remaining.load() > 0) {
+		Range range;
+		if (!pop(slot, range) && !steal(slot, range)) {
+			// всё уже разобрано, но кто-то ещё работает
+			this_thread::yield();
+			continue;
+		}
+
+		// делим диапазон, оставляя вторую половину для перехвата
+		while (range.end - range.begin > _grain) {
+			size_t mid = range.begin + (range.end - range.begin) / 2;
+			push(slot, Range{ mid, range.end });
+			range.end = mid;
+		}
+
+		for (size_t i = range.begin; i < range.end; ++i)
+			(*_func)(i);
+
+		_remaining.fetch_sub(range.end - range.begin);
+	}
+}
+
+void Scheduler::push(size_t slot, const Range& range)
+{
+	Queue& q = *_queues[slot];
+	lock_guard<mutex> lock(q.mutex);
+	q.ranges.push_back(range);
+}
+
+bool Scheduler::pop(size_t slot, Range& range)
+{
+	Queue& q = *_queues[slot];
+	lock_guard<mutex> lock(q.mutex);
+	if (q.ranges.empty())
+		return false;
+
+	range = q.ranges.back();
+	q.ranges.pop_back();
+	return true;
+}
+
+bool Scheduler::steal(size_t slot, Range& range)
+{
+	size_t slots = _queues.size();
+	for (size_t k = 1; k < slots; ++k) {
+		Queue& q = *_queues[(slot + k) % slots];
+		lock_guard<mutex> lock(q.mutex);
+		if (q.ranges.empty())
+			continue;
+
+		range = q.ranges.front();
+		q.ranges.pop_front();
+		return true;
+	}
+
+	return false;
+}
+
+void Scheduler::stopThreads()
+{
+	{
+		lock_guard<mutex> lock(_mutex);
+		_stop = true;
+	}
+	_wake.notify_all();
+
+	for (auto& thr : _threads)
+		thr.join();
+	_threads.clear();
+}
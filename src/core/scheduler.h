@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+
+namespace Basis
+{
+	/// @brief Пул потоков с перехватом работы (work stealing).
+	///
+	/// Каждый поток имеет собственную очередь диапазонов индексов. Поток берёт работу
+	/// с конца своей очереди, а когда она пуста - забирает диапазоны с начала чужих
+	/// очередей. Большие диапазоны перед выполнением делятся пополам, и вторая
+	/// половина возвращается в очередь, чтобы её могли перехватить другие потоки.
+	class Scheduler
+	{
+	public:
+		Scheduler();
+		~Scheduler();
+		Scheduler(const Scheduler&) = delete;
+		Scheduler& operator=(const Scheduler&) = delete;
+
+		/// @brief Установить общее число потоков (включая вызывающий).
+		///
+		/// Значение 1 означает последовательное выполнение в вызывающем потоке.
+		void setThreadCount(int n);
+		/// @brief Получить общее число потоков (включая вызывающий).
+		int threadCount() const;
+		/// @brief Номер очереди текущего потока: 0 для всех потоков, кроме рабочих.
+		static size_t currentSlot();
+		/// @brief Выполнить func(i) для всех i из [0, n) и дождаться завершения.
+		///
+		/// Вызывающий поток участвует в работе наравне с рабочими потоками.
+		/// Вложенные вызовы (из func или из другого потока во время задания)
+		/// выполняются последовательно в вызывающем потоке.
+		void parallelFor(size_t n, const std::function<void(size_t)>& func);
+
+	private:
+		struct Range
+		{
+			size_t begin;
+			size_t end;
+		};
+
+		struct Queue
+		{
+			std::mutex mutex;
+			std::deque<Range> ranges;
+		};
+
+		void threadFunc(size_t slot);
+		void work(size_t slot);
+		void push(size_t slot, const Range& range);
+		bool pop(size_t slot, Range& range);
+		bool steal(size_t slot, Range& range);
+		void stopThreads();
+
+	private:
+		std::vector<std::thread> _threads;             /// рабочие потоки
+		std::vector<std::unique_ptr<Queue>> _queues;   /// очереди (0 - вызывающий поток)
+		std::mutex _mutex;                             /// защита _generation и _stop
+		std::condition_variable _wake;                 /// пробуждение рабочих потоков
+		uint64_t _generation = 0;                      /// номер текущего задания
+		bool _stop = false;                            /// флаг завершения рабочих потоков
+		const std::function<void(size_t)>* _func = nullptr; /// текущее задание
+		size_t _grain = 1;                             /// минимальный размер делимого диапазона
+		std::atomic<size_t> _remaining = { 0 };        /// число ещё не выполненных индексов
+		std::atomic<int> _busy = { 0 };                /// число рабочих потоков внутри задания
+		std::atomic<bool> _running = { false };        /// выполняется задание parallelFor
+	};
+};
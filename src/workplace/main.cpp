@@ -15,7 +15,33 @@ namespace po = boost::program_options;
 
 int main(int argc, char* argv[])
 {
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "produce help message")
+		("exec", po::value<string>(), "execute commands from batch file before start")
+		("headless", po::value<uint64_t>(), "make N steps at full speed without console, print statistics and exit")
+		("bench", "run performance benchmarks and exit")
+		("compact-ids", "use compact entity ids (session prefix + counter) instead of random UUIDs")
+		;
+
+	po::variables_map vm;
+	try {
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	}
+	catch (const po::error& e) {
+		cout << e.what() << endl << desc << endl;
+		return 1;
+	}
+
+	if (vm.count("help")) {
+		cout << desc << endl;
+		return 0;
+	}
+
 	System* system = System::instance();
+	if (vm.count("compact-ids"))
+		system->setIdMode(IdMode::Compact);
 
 	cout << "Testing... " << endl;
 	if (!Basis::Test::test()) {
@@ -25,10 +51,24 @@ int main(int argc, char* argv[])
 	}
 	cout << "Testing: OK" << endl;
 
+	if (vm.count("bench")) {
+		Basis::Test::benchmark();
+		return 0;
+	}
+
+	if (vm.count("exec"))
+		system->executeBatchFile(vm["exec"].as<string>());
+
+	// Прогон без консоли: заданное число шагов без задержек, затем выход.
+	if (vm.count("headless")) {
+		system->printRunStats(system->run(vm["headless"].as<uint64_t>()));
+		return 0;
+	}
+
 	system->printWelcome();
 
 	CommandReader cr;
-	cr.addReceiver(std::bind(&System::onCommand, system, std::placeholders::_1));
+	cr.addReceiver(std::bind(&System::postCommand, system, std::placeholders::_1));
 	cr.start();
 
 	// Основной рабочий цикл.